@@ -1,5 +1,10 @@
 /*** includes ***/
 
+//getline、mmap等函数需要打开这些特性宏
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include<unistd.h>
 #include<termios.h>
 #include<stdlib.h>
@@ -9,28 +14,168 @@
 #include<sys/ioctl.h>
 #include<string.h>
 #include<sys/types.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include<sys/uio.h>
+#include<sys/inotify.h>
+#include<fcntl.h>
+#include<stdarg.h>
+#include<time.h>
+#include<pthread.h>
+#include<poll.h>
+#include<signal.h>
+#include<limits.h>
+#include<regex.h>
+#include<stdint.h>
+#include<stddef.h>
+#if defined( __x86_64__) || defined( __i386__)
+#include<immintrin.h>
+#endif
+
+#ifdef KILO_BENCH
+//测试版本统计内存分配次数，用来得到每帧的分配次数
+long long bench_allocs;
+void* bench_count_alloc( void* p){
+  __atomic_fetch_add( &bench_allocs, 1, __ATOMIC_RELAXED);
+  return p;
+}
+#define malloc( n) bench_count_alloc( malloc( n))
+#define calloc( n, m) bench_count_alloc( calloc( n, m))
+#define realloc( p, n) bench_count_alloc( realloc( p, n))
+#define strdup( s) bench_count_alloc( strdup( s))
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /*** function&struct defines ***/
 struct String_buff;
 struct Text_config;
+struct Text_buffer;
+struct Arena;
+typedef struct String_row String_row;
+typedef struct Row_piece Row_piece;
+typedef struct Text_file Text_file;
 void clear_screen();  //清除屏幕
 void output_draw_rows( struct String_buff* strb );  //在每一行开头绘制-
 void refresh_screen(); //屏幕打印
+void output_draw_line( struct String_buff* strb, int row_); //生成一个屏幕行的内容
+void output_scroll_region( struct String_buff* strb); //用终端滚动区域移动已有内容
+void shadow_reverse( int from, int to); //反转影子缓冲区中的一段行
+long long now_ns(); //单调时钟的当前时间(纳秒)
+void output_write_stdout( const char* b, int len); //把输出写到终端
+#ifdef KILO_TRACE
+void trace_add( int kind, long long start_ns, long long dur_ns, int arg); //记录一个跟踪区间
+void trace_frame_end( long long start_ns, long long end_ns); //一帧结束时记录
+void trace_draw_overlay( struct String_buff* strb); //生成性能浮层
+void trace_init();  //开始跟踪
+#endif
+void string_buff_append_repeat( struct String_buff* strb, char c, int n); //追加n个相同字符
+void string_buff_appendf( struct String_buff* strb, const char* fmt, ...); //按printf格式追加
 void error_information( const char* s); //错误信息打印，当函数错误时手动调用
 void disable_raw_mode();  //得到terminal的副本，配合atexit()函数在程序结束时还原terminal
 void enable_raw_mode(); //设置终端属性
 int get_window_size( int* rows, int* cols); //得到窗口大小
+int get_window_size_ioctl( int* rows, int* cols); //只用TIOCGWINSZ得到窗口大小，不探测终端
 int get_read_from_keyboard();  //从键盘读取字符
 void input_system();  //input system
+void input_process_key( int c); //处理一个按键
+void text_paste( const char* s, int len); //插入粘贴的文字
 void init_text(); //初始化myText
+void init_text_state( int rows, int cols); //初始化编辑器状态，不涉及终端
 int get_cursor_position( int* rows, int* cols);  //获得光标位置
+void text_resize(); //窗口大小改变后调整屏幕和影子缓冲区
+void event_wake();  //唤醒主循环
+int read_byte_timeout( char* c, int timeout_ms); //限时读一个字节
+int event_wait( int timeout_ms);  //等待标准输入或其他事件
+void event_add( int fd, void ( *on_ready)( int fd)); //注册事件源
+void event_init();  //创建自管道并安装SIGWINCH处理函数
+int cursor_step( int dir); //光标移到上一行或下一行
 void move_cursor( int key); //移动光标位置
-void text_open( char* filename); //打开文件
-void text_append_row( char* s, size_t len); //添加一行
+int text_open( char* filename); //在当前缓冲区中打开文件
+void text_close();  //关闭当前缓冲区的文件，释放所有行
+void text_open_memory( char* data, size_t size); //把内存中的内容作为当前缓冲区的文件
+struct Text_buffer* buffer_new(); //新建一个空的缓冲区
+void buffer_switch( struct Text_buffer* b); //切换到缓冲区b
+void buffer_trim_caches(); //只让最近用过的几个缓冲区保留行缓存
+int buffer_edited( struct Text_buffer* b); //缓冲区有没有编辑过
+int buffer_index(); //当前缓冲区在列表中的位置
+int buffer_open( char* filename); //在新的缓冲区中打开文件
+void buffer_close();  //关闭当前缓冲区
+void buffer_next( int dir); //切换到后一个或前一个缓冲区
+void buffer_prompt_open();  //Ctrl-O提示输入文件名并打开
+int follow_start( Text_file* f, const char* path); //开始跟随文件的变化
+void follow_stop( Text_file* f);  //停止跟随文件
+void follow_on_event( int fd);  //inotify报告变化
+void follow_sync(); //处理跟随的文件的变化
+void follow_reload( Text_file* f, const char* why); //重新打开文件
+void index_cache_open( Text_file* f, const char* filename); //找到并映射文件的行索引缓存
+void index_cache_begin( Text_file* f);  //加载线程开始写行索引缓存
+void index_cache_write( Text_file* f, int from, int to);  //把即将发布的行写入缓存
+void index_cache_finish( Text_file* f, int lines, int stopped); //写好文件头，换成正式的缓存文件
+void index_cache_check( Text_file* f, int line);  //实体化行时检查缓存的行索引
+void index_cache_sync();  //缓存过时的文件重新打开
+void hl_lines_free(); //释放当前缓冲区自己记录的原始行高亮状态
+void text_save(); //Ctrl-S：在后台保存
+void text_save_sync();  //保存线程结束后显示结果
+void text_save_wait();  //等待正在进行的保存完成
+void* arena_alloc( struct Arena* a, size_t size); //从arena分配
+void arena_free( struct Arena* a, void* p, size_t size);  //释放到arena的空闲链表
+void text_row_free( String_row* row); //释放编辑过的行
 void screen_scroll(); //屏幕滚动
-void text_update_row( String_row* row); // 使用原本字符串字符串填充render字符串
+void hl_update_viewport();  //保证可见各行的高亮状态已知
+unsigned char* hl_row_colors( int at, String_row* row, int col_off, int cols); //生成一行显示窗口中各字节的颜色
+void hl_mark_dirty( int at);  //第at行以后的高亮状态可能已经过时
+void text_select_syntax();  //按文件名选择语法规则
+int text_syntax_to_color( int hl);  //颜色类别对应的SGR前景色
+void text_update_row( String_row* row); //行内容改变后作废列检查点和行标志
+void text_row_changed( String_row* row, int at, const char* s, int len);  //行的at处改变后只作废后面的列检查点
+String_row* text_row_scan( String_row* row); //需要时扫描编辑过的行的行标志
+int text_row_cx_to_rx( String_row* row, int cx); //字符位置转换为显示位置
+int text_row_rx_to_cx( String_row* row, int rx, int* start_rx); //显示位置转换为字符位置
+void text_row_draw( struct String_buff* strb, String_row* row, int col_off, int cols, const unsigned char* hl);  //只展开显示窗口内的字符
+int text_row_next_char( int at, int cx); //第at行中cx之后一个字符的位置
+int text_row_prev_char( int at, int cx); //第at行中cx之前一个字符的位置
+int text_row_snap_char( int at, int cx); //cx落在多字节字符中间时退到字符开头
+void text_load_start( Text_file* f); //启动加载线程建立行索引
+void text_load_continue( Text_file* f); //从已建立索引的地方继续启动加载线程
+void text_load_sync();  //把加载线程已发布的行接入片段树
+int text_load_percent(); //已加载的百分比
+void piece_append_original( int first, int n); //在末尾追加原始行
+void row_cache_reset(); //清空未修改行的缓存
+void row_cache_drop( int line);  //把一个原始行从缓存中去掉
+void output_draw_status_bar( struct String_buff* strb); //生成状态栏内容
+void output_draw_message_bar( struct String_buff* strb); //生成消息栏内容
+void scan_init(); //根据CPU支持情况选择扫描内核
+void utf8_init(); //生成字符显示宽度表
+const char* search_memmem_libc( const char* h, size_t n, const char* q, size_t m); //glibc的memmem
+#if defined( __x86_64__) || defined( __i386__)
+const char* search_memmem_avx2( const char* h, size_t n, const char* q, size_t m); //AVX2搜索内核
+#endif
+String_row* text_row_at( int at); //得到第at行，第一次访问时才实体化
+int text_row_size( int at); //第at行的长度，不实体化
+unsigned text_row_flags( int at); //第at行的行标志，不实体化
+String_row* text_row_edit( int at);  //得到第at行的可修改副本
+void text_row_insert( int at, const char* s, size_t len); //在第at行前插入一行
+void text_row_delete( int at);  //删除第at行
+void text_insert_char( int c);  //在光标处插入字符
+void text_insert_newline(); //在光标处换行
+void text_delete_char();  //删除光标前的字符
+void text_row_insert_string( String_row* row, int at, const char* s, size_t len); //在行的at处插入字符串
+void text_row_delete_range( String_row* row, int at, int len);  //删除行中的一段
+void text_split_row( int y, int x); //在第y行的x处拆成两行
+void text_join_row( int y); //把下一行接到第y行末尾
+void undo_begin();  //开始一个新的撤销组
+void undo_record( int type, int y, int x, const char* s, int len); //记录一个编辑操作
+void text_undo(); //Ctrl-Z：撤销
+void text_redo(); //Ctrl-Y：重做
+void undo_reset();  //清空撤销日志
+void undo_init(); //初始化撤销日志
+char* text_prompt( const char* prompt, void ( *callback)( char* buf, int key)); //在消息栏读入一行文字
+void text_find(); //增量搜索
+void search_init(); //选择搜索线程数量
+void grep_sync(); //把完成的grep分片并入匹配列表
+int grep_key( int c); //grep视图中的按键
+void text_grep(); //Ctrl-G进入grep视图
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /*** defines ***/
@@ -41,8 +186,86 @@ void text_update_row( String_row* row); // 使用原本字符串字符串填充r
 #define KILO_VERSION "0.0.1"
 
 #define TAB_STOP 8
+#define COL_MARK_STEP 1024  //含tab的行每隔多少字节记一个显示列检查点
+
+#define ROW_CACHE_SIZE 1024  //已实体化行缓存的项数，需大于屏幕行数
+#define ROW_CACHE_BUCKETS ( ROW_CACHE_SIZE * 2) //缓存哈希桶数，必须是2的幂
+#define BUFFER_CACHED 4 //最多几个缓冲区保留行缓存和列检查点，其余不活动的缓冲区释放它们
+
+#define ESC_TIMEOUT_MS 50 //ESC之后等待转义序列后续字节的时间
+#define EVENT_MAX 8 //除标准输入外最多的事件源数量
+#define INPUT_BUF_SIZE 65536  //输入缓冲区大小，一次read读入所有已到达的输入
+
+#define ARENA_BLOCK ( 1 << 20)  //arena每次向系统申请的大块
+#define ARENA_MAX_SIZE 65536  //最大的大小级别，更大的单独分配
+#define ARENA_CLASSES 24  //16到256每16字节一级共16级，512到65536按2的幂共8级
+
+#ifdef KILO_TRACE
+#define TRACE_RING 65536  //跟踪环形缓冲区的项数
+#define TRACE_STATS 256 //浮层统计最近的多少帧
+enum Trace_kind{
+  TRACE_FRAME,  //refresh_screen整帧
+  TRACE_SCROLL, //screen_scroll
+  TRACE_DRAW, //output_draw_rows
+  TRACE_WRITE,  //写到终端
+  TRACE_WAIT, //get_read_from_keyboard中等待输入
+  TRACE_KEYS, //处理一批按键
+  TRACE_INPUT_TO_PAINT, //输入到达到画完对应的一帧
+  TRACE_KINDS
+};
+#define TRACE_BEGIN( var) long long var = now_ns()  //开始一个区间
+#define TRACE_END( kind, var) trace_add( kind, var, now_ns() - var, 0) //结束区间并记录
+#define TRACE_SYSCALL() ( ++trace.syscalls) //统计主线程的系统调用
+#else
+#define TRACE_BEGIN( var)
+#define TRACE_END( kind, var)
+#define TRACE_SYSCALL()
+#endif
+
+#define HL_HIGHLIGHT_NUMBERS ( 1 << 0)
+#define HL_HIGHLIGHT_STRINGS ( 1 << 1)
+#define HL_UNKNOWN -1 //行尾状态还没有算过
+#define HL_SYNC_LINES 1000  //跳到没算过的地方时最多往上找多少行已知的状态
+#define HL_LINE_MAX ( 1 << 20)  //超过这个长度的行不着色
+
+#define UNDO_MEM_MB 64 //撤销日志默认的内存上限(MB)
+#define UNDO_MERGE_MS 1000 //间隔不超过这个时间的连续输入合并成一个撤销操作
+
+#define SAVE_IOV 1024 //一次writev最多的段数
+#define SAVE_COPY_MIN ( 64 << 10) //不小于这个长度的原始内容用copy_file_range复制
+#define SAVE_SYNC_BYTES ( 64 << 20) //每写这么多字节让内核开始回写
+
+#define SEARCH_QUERY_MAX 256 //搜索内容的最大长度
+#define SEARCH_SHARD_BYTES ( 16 << 20)  //一个搜索分片最多扫描的字节数
+#define SEARCH_SHARD_ROWS 4096  //编辑过的行每个分片的行数
+#define SEARCH_SHARD_HITS 16384 //每个分片最多记录的匹配位置，更多的只计数
+#define SEARCH_MAX_THREADS 16 //搜索工作线程的最大数量
+
+#define GREP_SHARD_BYTES ( 1 << 20) //grep分片的字节数，小一些结果按顺序出现得更快，取消时也停得更快
+
+#define LINE_CHUNK_SHIFT 16
+#define LINE_CHUNK ( 1 << LINE_CHUNK_SHIFT) //行索引每块的行数
+#define LINE_GROUP_SHIFT 4
+#define LINE_GROUP ( 1 << LINE_GROUP_SHIFT) //每组行记录一个起始偏移，组内的起始位置由长度累加得到
+#define LINE_LEN_MAX INT_MAX  //更长的行切成几行，行长度能放进String_row的int
+#define FOLLOW_SYNC_BYTES ( 1 << 20) //跟随文件时，追加的内容不超过这么多直接在主线程建立索引，更多的交给加载线程
+#define INDEX_CACHE_MIN ( 32 << 20) //小于这个大小的文件扫描很快，不写行索引缓存
+#define INDEX_DATA_OFF 4096 //缓存文件中文件头和路径占第一页，行索引的块从这里开始
+#define INDEX_SAMPLES 16  //计算内容哈希时均匀抽取的块数
+#define INDEX_SAMPLE_BYTES 4096 //每块的字节数
+
+//行标志，建立索引时由扫描内核一并得到
+#define ROW_HAS_TAB 0x01  //含有tab
+#define ROW_HAS_CTRL 0x02 //含有tab以外的控制字符(行尾的\r除外)
+#define ROW_HAS_HIGH 0x04 //含有非ASCII字节
+#define ROW_EOL_LF 0x08 //以'\n'结尾(文件最后一行可能没有)
+#define ROW_EOL_CR 0x10 //'\n'前还有一个'\r'
+#define ROW_HL_KNOWN 0x20  //原始行：已经算出行尾的高亮状态
+#define ROW_HL_COMMENT 0x40  //原始行：行尾在多行注释中
+#define ROW_FLAGS_UNKNOWN 0x80  //还没有扫描过
 
 enum Arrow_key{
+  BACKSPACE = 127,
   ARROW_LEFT = 1000,
   ARROW_RIGHT,
   ARROW_UP,
@@ -51,7 +274,11 @@ enum Arrow_key{
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  KEY_NONE, //没有按键，用于加载过程中、窗口大小改变后刷新屏幕
+  PASTE_START,  //括号粘贴开始 \x1b[200~
+  PASTE_END,  //括号粘贴结束 \x1b[201~
+  PASTE_DATA  //一段粘贴的文字，在text.paste_ptr和text.paste_len中
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -59,126 +286,816 @@ enum Arrow_key{
 /*** data ***/
 
 //存储一行文字
-typedef struct String_row {
+struct String_row {
   int size; //本行文字长度
-  char* one_row_string; //本行存储的文字
-  int rsize;  //用于不可打印的控制字符等
-  char* render; //不可打印的控制字符等的长度
-} String_row;
+  char* one_row_string; //本行存储的文字，直接指向文件映射，不以'\0'结尾
+  int cap;  //one_row_string的容量，为0表示指向文件映射，不归本行所有
+  int* col_marks; //含tab的行的列检查点，col_marks[i]为第i*COL_MARK_STEP个字节的显示列，按需向后计算
+  int col_mark_count; //已经算出的检查点个数，0表示还没有
+  int col_mark_cap; //col_marks的容量
+  unsigned flags; //ROW_HAS_TAB等行标志
+  int hl_state; //编辑过的行行尾的高亮状态，原始行的记在行索引中
+};
 
-//终端信息
-struct Text_config{
+//扫描内核：返回[p, end)中第一个'\n'的位置(没有时返回end)，*flags为这之前字节的行标志
+typedef const char* ( *Scan_line_fn)( const char* p, const char* end, unsigned* flags);
+
+//行索引的一块，按列分开存放：扫描长度和标志时只读这两个紧凑的数组，每行5.5字节
+typedef struct Line_chunk {
+  uint64_t group_start[LINE_CHUNK / LINE_GROUP]; //每组第一行在map中的偏移
+  uint32_t len[LINE_CHUNK]; //行长度，不含行尾的"\r\n"
+  unsigned char flags[LINE_CHUNK];  //行标志，包括行尾是"\n"还是"\r\n"
+} Line_chunk;
+
+//行索引缓存文件头，后面是文件的绝对路径，从INDEX_DATA_OFF开始是和内存中布局相同的行索引块
+typedef struct Index_header {
+  char magic[8];  //"KILOIDX1"
+  uint32_t chunk_lines; //LINE_CHUNK和sizeof( Line_chunk)，块的布局不同的版本写的缓存不能用
+  uint32_t chunk_bytes;
+  uint64_t size;  //写缓存时文件的长度、修改时间和抽样内容的哈希
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t hash;
+  uint64_t lines; //行数
+  uint32_t path_len;
+} Index_header;
+
+//未修改行的实体化缓存项，按LRU淘汰
+typedef struct Row_cache_entry {
+  String_row row;
+  int line; //缓存的原始行号，-1表示空
+  int prev, next; //LRU链表，表头是最近使用的
+  int hash_next;  //同一哈希桶中的下一项
+} Row_cache_entry;
+
+//行片段树(piece table)的节点，所有片段按行号顺序组成一棵treap
+//ORIGINAL片段引用文件映射中连续的lines行，不复制内容；ADDED片段是编辑产生的一行，自己持有内容
+struct Row_piece {
+  Row_piece* left;
+  Row_piece* right;
+  unsigned int priority;  //treap的随机优先级，父节点不小于子节点
+  int count;  //整棵子树的行数，用于按行号查找
+  int first;  //ORIGINAL片段的起始原始行号，ADDED片段为-1
+  int lines;  //本片段的行数，ADDED片段为1
+  String_row* row;  //ADDED片段持有的行
+};
+
+//搜索内核：和memmem相同，在[h, h+n)中找q
+typedef const char* ( *Search_fn)( const char* h, size_t n, const char* q, size_t m);
+
+//搜索时片段树展开成的一段，ORIGINAL段是map中连续的原始行，ADDED段是连续的编辑过的行
+typedef struct Search_segment {
+  int row;  //段的第一行的行号
+  int first;  //ORIGINAL段的起始原始行号，ADDED段为-1
+  int lines;
+  String_row** rows;  //ADDED段的各行
+} Search_segment;
+
+//搜索分片，由一个工作线程扫描
+//匹配位置用一个键表示：ORIGINAL段是map中的偏移，ADDED段是 行号<<32|列，同一分片内键的顺序就是文字的顺序
+typedef struct Search_shard {
+  int seg;
+  long long from, to; //ORIGINAL段为map中的字节范围，ADDED段为行号范围
+  long long* hits;  //记录的匹配位置，从键window_from开始最多SEARCH_SHARD_HITS个
+  int hit_count;
+  int more; //记录满了，后面还有没记录的匹配
+  long long window_from;
+  long long count;  //分片中的匹配总数
+  int done; //已扫描完，原子访问
+} Search_shard;
+
+//一次搜索(Ctrl-F到回车或ESC)的状态，提示框打开期间不会编辑，展开的段和分片一直有效
+struct Search_state {
+  char query[SEARCH_QUERY_MAX]; //当前搜索的内容
+  int qlen;
+  int cached; //上一次的结果完整，内容只是加长时只需检查上一次的匹配位置
+  Search_segment* segs;
+  int seg_count;
+  Search_shard* shards;
+  int shard_count;
+  int origin_shard; //开始搜索时光标所在的分片，从这里开始按顺序找第一个匹配
+  long long origin_key;
+  int next_shard; //工作线程下一个要领取的分片，原子访问
+  int cancel; //要求工作线程提前结束，原子访问
+  int filter; //本次只过滤上一次的匹配位置
+  pthread_t threads[SEARCH_MAX_THREADS];
+  int running;  //正在运行的工作线程数量
+  int thread_count; //使用的工作线程数量
+  int seg_cap, shard_cap;
+  int cur_step; //当前匹配在从origin_shard开始的顺序中的位置，-1表示还没有
+  long long cur_key;
+  int saved_cx, saved_cy, saved_row_off, saved_col_off; //ESC时恢复
+};
+
+//grep分片：ORIGINAL段中连续的几行或ADDED段中的几行，由一个工作线程扫描，得到按顺序的匹配行号
+typedef struct Grep_shard {
+  int seg;
+  int row;  //分片第一行的行号
+  long long from, to; //ORIGINAL段为map中的字节范围(在行首切开)，ADDED段为行号范围
+  int* rows;  //匹配的行号
+  int count, cap;
+  int done; //扫描完成，原子访问
+} Grep_shard;
+
+//grep视图：只显示匹配正则表达式的行，绘制和移动光标都通过匹配行号的紧凑列表进行
+//工作线程按顺序领取分片，主线程把从头开始连续完成的分片并入列表，结果从上往下逐步出现
+struct Grep_state {
+  int active; //是否在grep视图中
+  char pattern[SEARCH_QUERY_MAX];
+  regex_t re[SEARCH_MAX_THREADS]; //每个工作线程一份，glibc的regexec对同一个regex_t加锁
+  int re_count;
+  const char* map;  //开始时当前缓冲区的映射，工作线程不访问text.buf
+  Search_segment* segs;
+  int seg_count, seg_cap;
+  Grep_shard* shards;
+  int shard_count, shard_cap;
+  int merged; //已经按顺序并入rows的分片数
+  int next_shard; //工作线程下一个要领取的分片，原子访问
+  int cancel; //要求工作线程提前结束，原子访问
+  pthread_t threads[SEARCH_MAX_THREADS];
+  int running;  //正在运行的工作线程数量
+  int stopped;  //扫描被Ctrl-G停下，列表只有前一部分
+  int* rows;  //匹配的行号，从小到大，视图中第i行显示rows[i]
+  int count, cap;
+  int cur;  //光标所在的匹配序号
+  int off;  //屏幕第一行的匹配序号
+};
+
+//arena从系统申请的一个大块，头部之后依次切出小块
+typedef struct Arena_block {
+  struct Arena_block* next;
+  size_t used;  //已使用的字节数，包括16字节的头部，切出的空间16字节对齐
+} Arena_block;
+
+//超过最大大小级别时单独分配的空间
+typedef struct Arena_big {
+  struct Arena_big* prev;
+  struct Arena_big* next;
+} Arena_big;
+
+//按大小级别分配的内存池
+struct Arena {
+  Arena_block* block; //当前的大块，已用完的大块链在它后面
+  Arena_big* big;
+  void* free_list[ARENA_CLASSES]; //每个大小级别已释放、可以复用的空间
+};
+
+#ifdef KILO_TRACE
+//跟踪记录的一个区间
+typedef struct Trace_event {
+  int kind;
+  int arg;  //整帧区间记录这一帧周期内的系统调用次数
+  long long start_ns;
+  long long dur_ns;
+} Trace_event;
+
+//跟踪状态，只有主线程写入
+struct Trace_state {
+  Trace_event ring[TRACE_RING];
+  long long count;  //记录过的区间总数，最新的在ring[(count-1)%TRACE_RING]
+  long long syscalls; //系统调用总数
+  long long frame_syscalls; //上一帧结束时的系统调用总数
+  long long input_ns; //最早的还没画出来的输入到达的时间，0表示没有
+  long long base_ns;  //开始跟踪的时间，输出时作为0点
+  int overlay;  //是否显示性能浮层
+};
+#endif
+
+//因为C没有动态字符串，设置一种字符串，可以在原字符串上追加字符
+struct String_buff {
+  char* b;
+  int len;
+  int cap;  //已分配的空间
+};
+
+//主循环中除标准输入外的一个事件源
+struct Event_source {
+  int fd;
+  void ( *on_ready)( int fd); //fd可读时调用
+};
+
+//高亮的颜色类别
+enum Text_highlight{
+  HL_NORMAL = 0,
+  HL_COMMENT, //单行注释
+  HL_MLCOMMENT, //多行注释
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_ALERT, //日志中的ERROR等
+  HL_STRING,
+  HL_NUMBER
+};
+
+//一种文件类型的语法规则
+struct Text_syntax {
+  char* filetype;
+  char** filematch; //以'.'开头的匹配扩展名，否则匹配文件名中的一段
+  char** keywords;  //以'|'结尾的是第二类关键字，以'!'结尾的醒目显示
+  char* singleline_comment_start;
+  char* multiline_comment_start;
+  char* multiline_comment_end;
+  int flags;
+};
+
+//撤销日志中的操作类型，相邻的两个互为逆操作
+enum Undo_type{
+  UNDO_INSERT,  //在(y, x)插入bytes
+  UNDO_DELETE,  //删除(y, x)处的bytes
+  UNDO_SPLIT, //在(y, x)拆行
+  UNDO_JOIN,  //把y + 1行接到y行末尾，接在x处
+  UNDO_ROW_ADD, //在y处加一个空行
+  UNDO_ROW_DELETE //删除y处的空行
+};
+
+//撤销日志的一项
+typedef struct Undo_op {
+  int type;
+  int y, x;
+  int len;  //bytes的长度
+  int cap;  //bytes的容量，合并连续输入时增长
+  char* bytes;  //插入或删除的内容，在undo.arena中
+  long long group;  //同一个按键产生的操作一起撤销
+  long long ns; //最后一次记录的时间，用于合并连续输入
+} Undo_op;
+
+//撤销日志：ops[first, count)有效，其中[first, cur)已执行，[cur, count)可以重做
+struct Undo_state {
+  Undo_op* ops;
+  int first, cur, count, cap;
+  struct Arena arena; //操作的内容
+  size_t mem; //日志占用的内存
+  size_t limit; //内存上限
+  long long group;  //当前按键的组号
+};
+
+//保存计划的一段：原文件映射中或编辑过的行的快照中的一段字节
+typedef struct Save_span {
+  int from_map; //1：映射中的字节，0：快照中的字节
+  size_t off;
+  size_t len;
+} Save_span;
+
+//一次保存(Ctrl-S)的状态，计划在主线程生成，保存线程只读
+struct Save_state {
+  Save_span* spans;
+  int span_count, span_cap;
+  struct String_buff edited;  //编辑过的行的快照，保存期间主线程可以继续修改行
+  const char* eol;  //编辑过的行使用的行尾
+  int final_eol;  //原文件最后一行有换行(或没有原始行)，最后一行是编辑过的行时据此决定是否写行尾
+  const char* map;  //原文件的映射，保存期间切换缓冲区也不变
+  size_t total; //要写的总字节数
+  char* path; //保存到的文件
+  int src_fd; //原文件的描述符，copy_file_range的来源，-1表示没有
+  int use_copy; //是否尝试copy_file_range
+  pthread_t thread;
+  int running;  //保存线程是否在运行(只有主线程访问)
+  int done; //保存线程已结束，原子访问
+  int error;  //失败时的errno
+  long long ns; //保存所用的时间
+};
+
+//一个打开的文件：只读的内容和行索引，打开同一个文件的缓冲区共享，最后一个缓冲区关闭时释放
+//用dev/ino/size/mtime判断是不是同一个文件，文件改变后再打开时会得到新的映射
+struct Text_file {
+  Text_file* next;
+  int refs; //引用它的缓冲区数量
+  int shared; //是否可以被再次打开的缓冲区共享(映射的普通文件)
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  char* map;  //文件内容，优先通过mmap映射
+  size_t map_size;  //文件内容长度
+  int map_owned;  //map是否是malloc得到的(无法mmap时读入内存)
+  int map_fd; //映射的文件的描述符，保存时作为copy_file_range的来源，-1表示没有
+  Line_chunk** line_chunks; //行索引的块目录，按文件大小一次分配好
+  size_t line_chunk_count;  //块目录的项数
+  pthread_t loader; //加载线程
+  int loader_joined;  //加载线程是否已回收，只有主线程访问
+  int loaded_lines; //加载线程已发布的行数，原子访问
+  int load_done;  //加载线程是否已结束，原子访问
+  int load_stop;  //要求加载线程提前结束，原子访问
+  size_t load_off;  //已建立索引的内容的结尾，追加内容时从这里继续
+  const struct Text_syntax* hl_syntax;  //行索引中的高亮状态是按哪种语法规则算的
+  int appends;  //追加过内容的次数，缓冲区据此发现映射和行索引改变
+  int follow; //是否跟随文件的变化(Ctrl-L或-f)
+  int follow_pending; //inotify报告过变化，还没有处理
+  char* path; //跟随时的文件路径，用来发现日志轮转
+  const char* name; //path中的文件名部分，和目录的inotify事件比较
+  int watch, dir_watch; //文件和所在目录的inotify监视，-1表示没有
+  char* index_path; //行索引缓存文件，NULL表示这个文件不使用缓存
+  char* index_key;  //文件的绝对路径，记在缓存文件头中
+  uint64_t index_hash;  //抽样内容的哈希
+  int index_fd; //加载线程正在写的缓存临时文件，-1表示没有
+  char* index_tmp;  //临时文件的路径，写完后改名为index_path
+  char* index_map;  //映射的缓存文件，行索引的块直接指向其中(私有映射，写入时复制)
+  size_t index_map_size;
+  int index_cached; //行索引来自缓存，实体化行时顺便检查
+  int index_stale;  //检查时发现缓存和文件内容不符，下一帧重新打开
+};
+
+//一个缓冲区：打开的文件和在它上面的编辑、光标和各种缓存
+struct Text_buffer {
   int cursor_x, cursor_y; //记录光标的行、列
+  int render_x; //光标在render中的列，tab展开后与cursor_x不同
   int row_off;  //记录用户当前滚动到文件的哪一行
   int col_off;  //记录用户当前滚动到文件的哪一列
+  int number_rows;  //记录行数量
+  Row_piece* rows;  //行片段树的根
+  struct Arena arena; //片段树节点和String_row
+  struct Arena grow;  //编辑过的行的内容和列检查点，按容量增长
+  Row_cache_entry* row_cache; //未修改行的实体化缓存，共ROW_CACHE_SIZE项，不活动时可以释放
+  int* row_bucket;  //缓存的哈希桶，按原始行号查找缓存项
+  int lru_head, lru_tail; //LRU链表的头尾
+  Text_file* file;
+  char* map;  //file->map等，常用的几项复制过来，少一次间接访问
+  size_t map_size;
+  int map_fd;
+  Line_chunk** line_chunks;
+  int line_count; //已接入片段树的原始行数量
+  int index_done; //是否已加载到文件末尾
+  char* filename; //打开的文件名
+  struct Text_syntax* syntax; //当前文件的语法规则，NULL表示不着色
+  int hl_dirty; //这一行及以后各行的高亮状态可能因为编辑而过时，INT_MAX表示没有
+  int hl_private; //编辑过或语法规则和file->hl_syntax不同：原始行的高亮状态记在hl_lines中，不写共享的行索引
+  unsigned char** hl_lines; //按行索引的块分开的原始行高亮状态，用到时才分配
+  size_t hl_line_count; //hl_lines的项数，跟随的文件块目录变大时跟着加长
+  struct Undo_state undo; //不是当前缓冲区时保存在这里的撤销日志
+  int appends;  //已经接入的file->appends
+  long long used; //最近一次成为当前缓冲区的时间(text.buffer_clock)
+};
+
+//终端信息
+struct Text_config{
+  struct Text_buffer* buf;  //当前缓冲区，切换缓冲区只改变这个指针
+  struct Text_buffer** buffers; //打开的所有缓冲区，按打开顺序
+  int buffer_count, buffer_cap;
+  long long buffer_clock; //切换缓冲区的次数，记在缓冲区的used中
+  Text_file* files; //打开的文件，按dev/ino/size/mtime去重
   int screen_rows;  //记录屏幕的行
   int screen_cols;  //记录屏幕的列
-  int number_rows;  //记录行数量
-  String_row* row;  //文件一行的string的指针--当作string数组用
+  int wake_pipe[2]; //自管道，信号处理函数和加载线程写入以唤醒主循环
+  int inotify_fd; //跟随文件变化的inotify描述符，第一次跟随时创建，-1表示没有
+  volatile sig_atomic_t window_changed; //收到SIGWINCH，窗口大小改变
+  struct Event_source events[EVENT_MAX];  //注册的事件源
+  int event_count;
+  char in_buf[INPUT_BUF_SIZE];  //输入缓冲区
+  int in_start, in_len; //未解码部分的开始位置和长度
+  int pasting;  //是否在括号粘贴中
+  int paste_cr; //粘贴中上一个字节是'\r'，后面的'\n'不再换行
+  const char* paste_ptr;  //PASTE_DATA对应的文字
+  int paste_len;
+  struct String_buff out; //一帧的输出缓冲区，跨帧复用
+  struct String_buff line;  //生成一个屏幕行时使用的缓冲区，跨帧复用
+  struct String_buff* shadow; //影子缓冲区：上一帧每个屏幕行输出的内容
+  int shadow_valid; //影子缓冲区是否与终端上的内容一致
+  int shadow_row_off; //影子缓冲区对应的row_off，用于判断滚动
+  int shadow_cursor_row; //上一帧结束时光标所在的屏幕行，窗口变矮时用来判断终端是否移动了内容
+  int frame_bytes;  //上一帧写到终端的字节数
+  long long total_bytes;  //写到终端的总字节数
+  long long frame_count;  //已输出的帧数
+  long long frame_build_ns; //上一帧生成输出内容所用的时间
+  long long frame_write_ns; //上一帧write所用的时间
+  long long total_build_ns; //生成输出内容的总时间
+  long long total_write_ns; //write的总时间
+  char message[128]; //消息栏的内容
+  char prompt_info[64]; //提示框后面附加的信息，例如匹配个数
+  unsigned char* hl_buf;  //绘制一行时各字节的颜色，跨行复用
+  int hl_cap;
   struct termios orig_termios;  //保存程序开始时的终端属性，用于程序结束后还原终端属性
 };
 
 struct Text_config text;
 
+char* C_HL_extensions[] = { ".c", ".h", ".cpp", ".cc", ".hpp", NULL};
+char* C_HL_keywords[] = {
+  "switch", "if", "while", "for", "break", "continue", "return", "else", "do", "goto", "sizeof",
+  "struct", "union", "typedef", "static", "enum", "class", "case", "default", "const", "extern",
+  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|", "void|", "short|", "size_t|", NULL
+};
+char* LOG_HL_extensions[] = { ".log", ".out", "syslog", "messages", NULL};
+char* LOG_HL_keywords[] = {
+  "ERROR!", "FATAL!", "PANIC!", "CRITICAL!", "error!", "fatal!",
+  "WARN", "WARNING", "warn", "warning",
+  "INFO|", "DEBUG|", "TRACE|", "NOTICE|", "info|", "debug|", "trace|", NULL
+};
+
+//语法规则数据库
+struct Text_syntax HLDB[] = {
+  { "c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+  { "log", LOG_HL_extensions, LOG_HL_keywords, NULL, NULL, NULL, HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+};
+
+Scan_line_fn scan_line_end; //当前使用的扫描内核，由scan_init()选择
+const char* scan_kernel_name;
+Search_fn search_memmem; //当前使用的搜索内核
+void ( *output_sink)( const char* b, int len) = output_write_stdout; //屏幕输出写到哪里，测试时换成不写终端的版本
+struct Search_state search;
+struct Grep_state grep;
+struct Save_state save;
+struct Undo_state undo;
+#ifdef KILO_TRACE
+struct Trace_state trace;
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /*** string buff ***/
-//因为C没有动态字符串，设置一种字符串，可以在原字符串上追加字符
-struct String_buff {
-  char* b;
-  int len;
-};
 
 // String buff初始化函数 ctor
 void string_buff_init( struct String_buff* strb){
   strb->b = NULL;
   strb->len = 0;
+  strb->cap = 0;
 }
 
-//在strb指向字符串后面追加字符串s
-void string_buff_append( struct String_buff* strb, const char* s, int len_ ){
-  char* new  = realloc( strb->b, strb->len+len_);
+//保证还能再追加len_字节，容量不够时按2倍增长，追加n次只需realloc O(log n)次
+int string_buff_reserve( struct String_buff* strb, int len_){
+  if( strb->len + len_ <= strb->cap)
+    return 0;
+  int new_cap = strb->cap ? strb->cap * 2 : 64;
+  while( new_cap < strb->len + len_)
+    new_cap *= 2;
+  char* new  = realloc( strb->b, new_cap);
   //void *realloc(void *ptr, size_t size);
     //改变内存块的大小
   if( new == NULL)
+    return -1;
+  strb->b = new;
+  strb->cap = new_cap;
+  return 0;
+}
+
+//在strb指向字符串后面追加字符串s
+void string_buff_append( struct String_buff* strb, const char* s, int len_ ){
+  if( len_ <= 0 || string_buff_reserve( strb, len_) == -1)
     return ;
 
-  memcpy( &new[ strb->len], s, len_);
+  memcpy( &strb->b[ strb->len], s, len_);
   //void *memcpy(void *s1, const void *s2, size_t n);
     //s1: 目标缓冲区地址
     //s2: 源缓冲区地址
     //n:  复制字节个数
-  strb->b = new;
   strb->len += len_;
 }
 
+//在strb后面追加n个字符c，代替逐个字符追加
+void string_buff_append_repeat( struct String_buff* strb, char c, int n){
+  if( n <= 0 || string_buff_reserve( strb, n) == -1)
+    return ;
+  memset( &strb->b[ strb->len], c, n);
+  strb->len += n;
+}
+
+//按printf格式在strb后面追加，直接格式化到缓冲区中，空间不够时才扩容后再格式化一次
+void string_buff_appendf( struct String_buff* strb, const char* fmt, ...){
+  va_list ap;
+  int room = strb->cap - strb->len;
+  va_start( ap, fmt);
+  int n = vsnprintf( room > 0 ? &strb->b[ strb->len] : NULL, room > 0 ? room : 0, fmt, ap);
+  va_end( ap);
+  if( n <= 0)
+    return ;
+  if( n >= room){
+    if( string_buff_reserve( strb, n + 1) == -1)
+      return ;
+    va_start( ap, fmt);
+    vsnprintf( &strb->b[ strb->len], n + 1, fmt, ap);
+    va_end( ap);
+  }
+  strb->len += n;
+}
+
+//清空内容但保留已分配的空间，下次使用时不需要再分配
+void string_buff_clear( struct String_buff* strb){
+  strb->len = 0;
+}
+
 //释放strb空间 dtor
 void string_buff_free( struct String_buff* strb){
   free( strb->b);
+  string_buff_init( strb);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*** arena ***/
+//片段树节点、编辑过的行以及列检查点不再逐个malloc，而是从1MB的大块中按大小级别切出
+//释放的空间挂在对应级别的空闲链表上复用，关闭文件时整个arena一次释放，不需要遍历每一行
+
+//size字节属于哪个大小级别：256字节以内每16字节一级，更大的按2的幂
+int arena_class( size_t size){
+  if( size <= 256)
+    return size == 0 ? 0 : ( int)( ( size + 15) / 16) - 1;
+  int c = 16;
+  while( ( ( size_t)512 << ( c - 16)) < size)
+    ++c;
+  return c;
+}
+
+//实际分配的大小，超过最大级别的按原大小单独分配
+size_t arena_round( size_t size){
+  if( size > ARENA_MAX_SIZE)
+    return size;
+  int c = arena_class( size);
+  return c < 16 ? ( size_t)( c + 1) * 16 : ( size_t)512 << ( c - 16);
+}
+
+//分配size字节
+void* arena_alloc( struct Arena* a, size_t size){
+  if( size > ARENA_MAX_SIZE){ //很长的行单独分配，挂在big链表上以便一起释放
+    Arena_big* big = malloc( sizeof( Arena_big) + size);
+    if( big == NULL)
+      error_information( "malloc");
+    big->prev = NULL;
+    big->next = a->big;
+    if( a->big)
+      a->big->prev = big;
+    a->big = big;
+    return big + 1;
+  }
+  int c = arena_class( size);
+  if( a->free_list[c]){
+    void* p = a->free_list[c];
+    a->free_list[c] = *( void**)p;
+    return p;
+  }
+  size = arena_round( size);
+  if( a->block == NULL || a->block->used + size > ARENA_BLOCK){
+    Arena_block* b = malloc( ARENA_BLOCK);
+    if( b == NULL)
+      error_information( "malloc");
+    b->next = a->block;
+    b->used = sizeof( Arena_block);
+    a->block = b;
+  }
+  void* p = ( char*)a->block + a->block->used;
+  a->block->used += size;
+  return p;
+}
+
+//释放p，size必须和分配时相同(或同一大小级别)
+void arena_free( struct Arena* a, void* p, size_t size){
+  if( p == NULL)
+    return;
+  if( size > ARENA_MAX_SIZE){
+    Arena_big* big = ( Arena_big*)p - 1;
+    if( big->prev)
+      big->prev->next = big->next;
+    else
+      a->big = big->next;
+    if( big->next)
+      big->next->prev = big->prev;
+    free( big);
+    return;
+  }
+  int c = arena_class( size);
+  *( void**)p = a->free_list[c];
+  a->free_list[c] = p;
+}
+
+//把p从old字节改为size字节，同一大小级别时不移动
+void* arena_realloc( struct Arena* a, void* p, size_t old, size_t size){
+  if( p && arena_round( old) == arena_round( size) && size <= ARENA_MAX_SIZE)
+    return p;
+  void* new_ = arena_alloc( a, size);
+  if( p){
+    memcpy( new_, p, old < size ? old : size);
+    arena_free( a, p, old);
+  }
+  return new_;
+}
+
+//一次释放arena中的所有空间
+void arena_release( struct Arena* a){
+  while( a->block){
+    Arena_block* next = a->block->next;
+    free( a->block);
+    a->block = next;
+  }
+  while( a->big){
+    Arena_big* next = a->big->next;
+    free( a->big);
+    a->big = next;
+  }
+  memset( a->free_list, 0, sizeof( a->free_list));
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /*** output system ***/
 
+//单调时钟的当前时间，单位纳秒，用于统计耗时
+long long now_ns(){
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts);
+  return ( long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//默认的输出：写到终端
+void output_write_stdout( const char* b, int len){
+  while( len > 0){
+    ssize_t n = write( STDOUT_FILENO, b, len);
+    TRACE_SYSCALL();
+    if( n == -1 && errno == EINTR)
+      continue;
+    if( n <= 0)
+      return;
+    b += n;
+    len -= n;
+  }
+}
+
 //清除屏幕
 void clear_screen() {
-  write(STDOUT_FILENO, "\x1b[2J", 4); //清除屏幕
-  write(STDOUT_FILENO, "\x1b[H", 3);  //重定位光标
+  output_sink( "\x1b[2J", 4); //清除屏幕
+  output_sink( "\x1b[H", 3);  //重定位光标
+  text.shadow_valid = 0;  //屏幕内容已清除，下一帧需要完整重画
 }
 
 void screen_scroll(){
-  if ( text.cursor_y < text.row_off)  //如果光标在可见窗口上方,则向上滚动到光标所在的位置
-    text.row_off = text.cursor_y;
-  if( text.cursor_y >= text.row_off + text.screen_rows) //查光标是否越过可见窗口的底部
-    text.row_off = text.cursor_y - text.screen_rows + 1;
-  if( text.cursor_x < text.col_off)
-    text.col_off = text.cursor_x;
-  if( text.cursor_x >= text.col_off + text.screen_cols)
-    text.col_off = text.cursor_x - text.screen_cols + 1;
+  if( grep.active && grep.count > 0){ //grep视图中光标只停在匹配的行上
+    if( grep.cur >= grep.count)
+      grep.cur = grep.count - 1;
+    if( text.buf->cursor_y != grep.rows[grep.cur]){
+      text.buf->cursor_y = grep.rows[grep.cur];
+      int len = text_row_size( text.buf->cursor_y);
+      if( text.buf->cursor_x > len)
+        text.buf->cursor_x = len;
+      text.buf->cursor_x = text_row_snap_char( text.buf->cursor_y, text.buf->cursor_x);
+    }
+  }
+  text.buf->render_x = 0;
+  if( text.buf->cursor_y < text.buf->number_rows){
+    text.buf->render_x = text.buf->cursor_x;
+    if( text_row_flags( text.buf->cursor_y) & ( ROW_HAS_TAB | ROW_HAS_HIGH | ROW_FLAGS_UNKNOWN)) //只有含tab或非ASCII字节的行显示位置和字符位置不同
+      text.buf->render_x = text_row_cx_to_rx( text_row_at( text.buf->cursor_y), text.buf->cursor_x);
+  }
+
+  int y = grep.active ? grep.cur : text.buf->cursor_y; //grep视图中按匹配序号滚动
+  int* off = grep.active ? &grep.off : &text.buf->row_off;
+  if ( y < *off)  //如果光标在可见窗口上方,则向上滚动到光标所在的位置
+    *off = y;
+  if( y >= *off + text.screen_rows) //查光标是否越过可见窗口的底部
+    *off = y - text.screen_rows + 1;
+  if( text.buf->render_x < text.buf->col_off)
+    text.buf->col_off = text.buf->render_x;
+  if( text.buf->render_x >= text.buf->col_off + text.screen_cols)
+    text.buf->col_off = text.buf->render_x - text.screen_cols + 1;
   
 }
 
-//在每一行的开头绘制-
-void output_draw_rows ( struct String_buff* strb ){
-  int row_ = -1;
-  for( row_ = 0; row_ < text.screen_rows; ++row_){ 
-    int file_row = row_ + text.row_off;
-    if( file_row > text.number_rows) {
-      if( text.number_rows == 0 && row_ == text.screen_rows / 3) {  
-        //当不是从文件系统打开文件时再在屏幕三分之一处显示欢迎信息，若打开文件则不显示
-        char welcome[100];
-        int welcome_len = snprintf( welcome, sizeof( welcome),
-          "myText -- Kilo -- version %s", KILO_VERSION);
-        if( welcome_len > text.screen_cols)
-          welcome_len = text.screen_cols;
-        int in_half = (text.screen_cols - welcome_len) / 2;
-        if( in_half){
-          string_buff_append( strb, "-", 1);
-          in_half--;
-        }
-        while( in_half--)
-          string_buff_append( strb, " ", 1);
-        string_buff_append( strb, welcome, welcome_len);
-      } else {
+//生成屏幕第row_行的内容(不含控制序列)，文件外的行开头绘制-
+void output_draw_line( struct String_buff* strb, int row_){
+  int file_row = row_ + text.buf->row_off;
+  if( grep.active)  //grep视图中屏幕行显示匹配列表中的行
+    file_row = row_ + grep.off < grep.count ? grep.rows[row_ + grep.off] : text.buf->number_rows;
+  if( file_row >= text.buf->number_rows) {
+    if( text.buf->number_rows == 0 && text.buf->filename == NULL && row_ == text.screen_rows / 3) {  
+      //当不是从文件系统打开文件时再在屏幕三分之一处显示欢迎信息，若打开文件则不显示
+      char welcome[100];
+      int welcome_len = snprintf( welcome, sizeof( welcome),
+        "myText -- Kilo -- version %s", KILO_VERSION);
+      if( welcome_len > text.screen_cols)
+        welcome_len = text.screen_cols;
+      int in_half = (text.screen_cols - welcome_len) / 2;
+      if( in_half){
         string_buff_append( strb, "-", 1);
+        in_half--;
       }
+      string_buff_append_repeat( strb, ' ', in_half);
+      string_buff_append( strb, welcome, welcome_len);
     } else {
-      int len = text.row[file_row].rsize - text.col_off;
-      if( len < 0)  //len 现在可以是负数，这意味着用户水平滚动超过了屏幕。将 len 设置为 0，不显示任何内容。
-        len = 0;
-      if( len > text.screen_cols )
-        len = text.screen_cols;
-      string_buff_append( strb, text.row[file_row].render[text.col_off], len);
+      string_buff_append( strb, "-", 1);
     }
+  } else {
+    //行滚动到可见区域时才实体化，只展开[col_off, col_off + screen_cols)这一段，用户水平滚动超过行尾时不显示任何内容
+    String_row* row = text_row_at( file_row);
+    text_row_draw( strb, row, text.buf->col_off, text.screen_cols, hl_row_colors( file_row, row, text.buf->col_off, text.screen_cols));
+  }
+}
+
+//生成状态栏内容：文件名、行数、加载进度以及光标所在行，反色显示
+void output_draw_status_bar( struct String_buff* strb){
+  char status[80], rstatus[80], which[32] = "";
+  int len = 0;
+  const char* follow = text.buf->file && text.buf->file->follow ? " [follow]" : "";
+  if( text.buffer_count > 1) //打开了多个文件时显示当前是第几个
+    snprintf( which, sizeof( which), "[%d/%d] ", buffer_index() + 1, text.buffer_count);
+  if( text.buf->index_done)
+    len = snprintf( status, sizeof( status), "%s%.40s - %d lines%s", which,
+      text.buf->filename ? text.buf->filename : "[No Name]", text.buf->number_rows, follow);
+  else
+    len = snprintf( status, sizeof( status), "%s%.40s - %d lines (loading %d%%)%s", which,
+      text.buf->filename ? text.buf->filename : "[No Name]", text.buf->number_rows, text_load_percent(), follow);
+  int rlen = snprintf( rstatus, sizeof( rstatus), "%s | %d/%d",
+    text.buf->syntax ? text.buf->syntax->filetype : "no ft", text.buf->cursor_y + 1, text.buf->number_rows);
+  if( len > text.screen_cols)
+    len = text.screen_cols;
+
+  string_buff_append( strb, "\x1b[7m", 4);
+    //m:选择图形再现(SGR)，7表示反色，不带参数的\x1b[m恢复正常
+  string_buff_append( strb, status, len);
+  if( text.screen_cols - len >= rlen){
+    string_buff_append_repeat( strb, ' ', text.screen_cols - len - rlen);
+    string_buff_append( strb, rstatus, rlen);
+  } else {
+    string_buff_append_repeat( strb, ' ', text.screen_cols - len);
+  }
+  string_buff_append( strb, "\x1b[m", 3);
+}
+
+//生成消息栏内容：提示框或其他消息
+void output_draw_message_bar( struct String_buff* strb){
+#ifdef KILO_TRACE
+  if( trace.overlay && text.message[0] == '\0'){
+    trace_draw_overlay( strb);
+    return;
+  }
+#endif
+  int len = strlen( text.message);
+  if( len > text.screen_cols)
+    len = text.screen_cols;
+  string_buff_append( strb, text.message, len);
+}
+
+//反转影子缓冲区中[from, to)的行
+void shadow_reverse( int from, int to){
+  while( from < --to){
+    struct String_buff tmp = text.shadow[from];
+    text.shadow[from++] = text.shadow[to];
+    text.shadow[to] = tmp;
+  }
+}
+
+//上一帧之后滚动了不多的几行时，让终端在滚动区域内整体移动已有内容，影子缓冲区同步移动
+//移出的行在终端上变成空行，影子中也记为空行，之后只需补画新露出的行
+void output_scroll_region( struct String_buff* strb){
+  int top = grep.active ? grep.off : text.buf->row_off;
+  int delta = top - text.shadow_row_off;
+  text.shadow_row_off = top;
+  if( !text.shadow_valid || delta == 0)
+    return;
+  int n = delta > 0 ? delta : -delta;
+  if( n >= text.screen_rows / 2){ //滚动太多时直接重画变化的行更省
+    return;
+  }
+
+  string_buff_appendf( strb, "\x1b[1;%dr", text.screen_rows);
+    //r:DECSTBM，设置滚动区域的上下边界
+  string_buff_appendf( strb, "\x1b[%d%c", n, delta > 0 ? 'S' : 'T');
+    //S:内容向上滚动n行，T:内容向下滚动n行
+  string_buff_append( strb, "\x1b[r", 3);
+    //恢复默认滚动区域(整个屏幕)
+
+  //把移出屏幕的影子行轮换到另一端并清空，保留它们已分配的空间
+  //循环左移k位 = 前k个反转、其余反转、整体反转，不需要额外空间
+  int k = delta > 0 ? n : text.screen_rows - n;
+  shadow_reverse( 0, k);
+  shadow_reverse( k, text.screen_rows);
+  shadow_reverse( 0, text.screen_rows);
+  int i = -1;
+  for( i = ( delta > 0 ? text.screen_rows - n : 0); i < ( delta > 0 ? text.screen_rows : n); ++i)
+    string_buff_clear( &text.shadow[i]);
+}
+
+//绘制所有屏幕行，只输出与上一帧(影子缓冲区)不同的行
+void output_draw_rows ( struct String_buff* strb ){
+  int row_ = -1;
+  int last_drawn = -2;  //上一个输出的屏幕行，相邻时用"\r\n"代替光标定位
+  output_scroll_region( strb);
+  for( row_ = 0; row_ <= text.screen_rows + 1; ++row_){ //最后两行是状态栏和消息栏
+    struct String_buff* line = &text.line;
+    string_buff_clear( line);
+    if( row_ < text.screen_rows)
+      output_draw_line( line, row_);
+    else if( row_ == text.screen_rows)
+      output_draw_status_bar( line);
+    else
+      output_draw_message_bar( line);
+
+    struct String_buff* old = &text.shadow[row_];
+    if( text.shadow_valid && old->len == line->len && ( line->len == 0 || memcmp( old->b, line->b, line->len) == 0))
+      continue; //和上一帧相同，不输出
+
+    if( last_drawn == row_ - 1)
+      string_buff_append( strb, "\r\n", 2);
+    else
+      string_buff_appendf( strb, "\x1b[%d;1H", row_ + 1);
+    string_buff_append( strb, line->b, line->len);
     string_buff_append( strb, "\x1b[K", 3);
     //k:擦除当前行的一部分, 默认参数为0
       //2:擦除整行
       //1:擦除光标左侧的部分行
       //0:擦除光标右侧的部分行
-    if( row_ < text.screen_rows - 1)
-      string_buff_append( strb, "\r\n", 2);
+    last_drawn = row_;
+
+    //新内容成为影子行，旧影子行的空间留作下一行的缓冲区，不需要分配
+    struct String_buff tmp = *old;
+    *old = *line;
+    *line = tmp;
   }
+  text.shadow_valid = 1;
 }
 
 //屏幕打印
@@ -215,39 +1132,156 @@ void refresh_screen() {
 */
 
   //第二版 通过string_buff刷新屏幕
+  long long start_ns = now_ns();
+  follow_sync();  //跟随的文件有变化时扩大映射，为追加的内容建立索引
+  index_cache_sync(); //显示时发现行索引缓存过时的文件重新打开
+  text_load_sync(); //接入加载线程已发布的行，从不等待加载线程
+  text_save_sync();
+  grep_sync();
+  TRACE_BEGIN( scroll_ns);
   screen_scroll();
+  TRACE_END( TRACE_SCROLL, scroll_ns);
+  hl_update_viewport(); //只为可见的行计算高亮状态
 
-  struct String_buff strb = { NULL, 0};
-  string_buff_init( &strb);
+  struct String_buff* strb = &text.out;  //输出缓冲区跨帧复用，稳定后每帧不再分配内存
+  string_buff_clear( strb);
 
-  string_buff_append( &strb, "\x1b[?25l", 6);
+  string_buff_append( strb, "\x1b[?25l", 6);
   //l:Reset Mode,用于重置各种终端功能或模式
 
-  string_buff_append( &strb, "\x1b[H", 3);
-  
-  output_draw_rows( &strb);
+  TRACE_BEGIN( draw_ns);
+  output_draw_rows( strb); //第三版 只输出和上一帧不同的行，不再每帧从\x1b[H开始重画
+  TRACE_END( TRACE_DRAW, draw_ns);
   
-  char buf[32];
+  int cursor_row = grep.active ? grep.cur - grep.off : text.buf->cursor_y - text.buf->row_off;
+  string_buff_appendf( strb, "\x1b[%d;%dH", cursor_row + 1, text.buf->render_x - text.buf->col_off + 1);
+  text.shadow_cursor_row = cursor_row;
   //int snprintf(char *str, size_t size, const char *format, ...)
     //str:目标字符串
     //size:字符数组大小
     //format:源字符串
     //...可变参数
-  snprintf( buf, sizeof(buf), "\x1b[%d;%dH", text.cursor_y - text.row_off + 1, text.cursor_x - text.col_off + 1);
-  
-  string_buff_append( &strb, buf, strlen(buf));
   
-  string_buff_append( &strb, "\x1b[?25h", 6);
+  string_buff_append( strb, "\x1b[?25h", 6);
   //h:Set Mode,用于打开各种终端功能或模式
 
-  write( STDOUT_FILENO, strb.b, strb.len);
-  
-  string_buff_free( &strb);
+  long long built_ns = now_ns();
+  output_sink( strb->b, strb->len);
+  long long written_ns = now_ns();
+#ifdef KILO_TRACE
+  trace_add( TRACE_WRITE, built_ns, written_ns - built_ns, 0);
+  trace_frame_end( start_ns, written_ns);
+#endif
 
+  text.frame_bytes = strb->len;  //统计每帧输出的字节数
+  text.total_bytes += strb->len;
+  text.frame_count++;
+  text.frame_build_ns = built_ns - start_ns;  //统计生成一帧和写出一帧各自的耗时
+  text.frame_write_ns = written_ns - built_ns;
+  text.total_build_ns += text.frame_build_ns;
+  text.total_write_ns += text.frame_write_ns;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+#ifdef KILO_TRACE
+
+/*** trace ***/
+//性能跟踪，只在 make trace (定义KILO_TRACE) 时编译：热路径上的区间记录到环形缓冲区，开销只是两次读时钟
+//Ctrl-T在消息栏显示最近帧的延迟统计，退出时把缓冲区写成Chrome trace格式(chrome://tracing 或 Perfetto 打开)
+
+const char* trace_names[TRACE_KINDS] = { "frame", "screen_scroll", "draw_rows", "write", "wait", "keys", "input_to_paint"};
+
+//记录一个区间
+void trace_add( int kind, long long start_ns, long long dur_ns, int arg){
+  Trace_event* e = &trace.ring[trace.count % TRACE_RING];
+  e->kind = kind;
+  e->start_ns = start_ns;
+  e->dur_ns = dur_ns;
+  e->arg = arg;
+  trace.count++;
+}
+
+//一帧结束：记录整帧、这一帧周期内的系统调用次数，以及最早的输入到这一帧画完的延迟
+void trace_frame_end( long long start_ns, long long end_ns){
+  trace_add( TRACE_FRAME, start_ns, end_ns - start_ns, trace.syscalls - trace.frame_syscalls);
+  trace.frame_syscalls = trace.syscalls;
+  if( trace.input_ns){
+    trace_add( TRACE_INPUT_TO_PAINT, trace.input_ns, end_ns - trace.input_ns, 0);
+    trace.input_ns = 0;
+  }
+}
+
+int trace_cmp_ll( const void* a, const void* b){
+  long long x = *( const long long*)a, y = *( const long long*)b;
+  return x < y ? -1 : x > y;
+}
+
+//最近TRACE_STATS个kind区间的p50、p99耗时和平均参数，返回区间个数
+int trace_stats( int kind, long long* p50, long long* p99, double* avg_arg){
+  long long durs[TRACE_STATS];
+  long long args = 0;
+  int n = 0;
+  long long i = trace.count;
+  while( i > 0 && i > trace.count - TRACE_RING && n < TRACE_STATS){
+    Trace_event* e = &trace.ring[--i % TRACE_RING];
+    if( e->kind != kind)
+      continue;
+    durs[n++] = e->dur_ns;
+    args += e->arg;
+  }
+  if( n == 0)
+    return 0;
+  qsort( durs, n, sizeof( long long), trace_cmp_ll);
+  *p50 = durs[n / 2];
+  *p99 = durs[n * 99 / 100];
+  *avg_arg = args / ( double)n;
+  return n;
+}
+
+//生成性能浮层的内容，显示在消息栏
+void trace_draw_overlay( struct String_buff* strb){
+  long long f50 = 0, f99 = 0, l50 = 0, l99 = 0;
+  double syscalls = 0, unused = 0;
+  char buf[160];
+  trace_stats( TRACE_FRAME, &f50, &f99, &syscalls);
+  trace_stats( TRACE_INPUT_TO_PAINT, &l50, &l99, &unused);
+  int len = snprintf( buf, sizeof( buf), "frame p50 %.2fms p99 %.2fms | input->paint p50 %.2fms p99 %.2fms | syscalls/frame %.1f",
+    f50 / 1e6, f99 / 1e6, l50 / 1e6, l99 / 1e6, syscalls);
+  if( len > text.screen_cols)
+    len = text.screen_cols;
+  string_buff_append( strb, buf, len);
+}
+
+//退出时把环形缓冲区中的区间写成Chrome trace JSON，文件名由KILO_TRACE_FILE指定，默认kilo_trace.json
+void trace_dump(){
+  const char* name = getenv( "KILO_TRACE_FILE");
+  FILE* f = fopen( name ? name : "kilo_trace.json", "w");
+  if( f == NULL)
+    return;
+  long long i = trace.count > TRACE_RING ? trace.count - TRACE_RING : 0;
+  fprintf( f, "{\"traceEvents\":[\n");
+  for( ; i < trace.count; ++i){
+    Trace_event* e = &trace.ring[i % TRACE_RING];
+    fprintf( f, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"syscalls\":%d}}%s\n",
+      trace_names[e->kind], e->kind == TRACE_INPUT_TO_PAINT ? 2 : 1, ( e->start_ns - trace.base_ns) / 1e3, e->dur_ns / 1e3,
+      e->arg, i + 1 < trace.count ? "," : "");
+      //输入到绘制的区间会和其他区间交叉，放在单独的一行(tid 2)
+  }
+  fprintf( f, "],\"displayTimeUnit\":\"ms\"}\n");
+  fclose( f);
+}
+
+//开始跟踪，退出时写出
+void trace_init(){
+  memset( &trace, 0, sizeof( trace));
+  trace.base_ns = now_ns();
+  atexit( trace_dump);
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /*** terminal ***/
 //错误信息打印，当函数错误时手动调用
@@ -263,6 +1297,7 @@ void error_information( const char* s){ //s:指向带有解释性消息的空终
 
 //得到terminal的副本，配合atexit()函数在程序结束时还原terminal
 void disable_raw_mode(){    
+  write( STDOUT_FILENO, "\x1b[?2004l", 8); //关闭括号粘贴模式
   if( tcsetattr( STDIN_FILENO, TCSAFLUSH, &text.orig_termios) == -1)
     error_information( "tcsetattr");
     //int tcsetattr(int fildes, int optional_actions, const struct termios *termios_p); 设置终端文件描述符参数
@@ -307,11 +1342,13 @@ void enable_raw_mode() {
   
   //c_cc 字段的索引，它代表“控制字符”，一个控制各种终端设置的字节数组。
   raw.c_cc[VMIN] = 0;   //VMIN 值设置 read() 返回之前所需的最小输入字节数。
-  raw.c_cc[VTIME] = 1;  //VTIME 值设置在 read() 返回之前等待的最长时间。
-    //单位是0.1s, 当read超时，返回0，逻辑符合
+  raw.c_cc[VTIME] = 0;  //VTIME 值设置在 read() 返回之前等待的最长时间。
+    //单位是0.1s。等待由poll完成，read只在有输入时调用，所以不让终端超时，空闲时不再每0.1s醒来一次
 
   if( tcsetattr( STDIN_FILENO, TCSAFLUSH, &raw) == -1 )
     error_information( "tcsetattr");
+  write( STDOUT_FILENO, "\x1b[?2004h", 8);
+    //打开括号粘贴模式：终端把粘贴的内容包在\x1b[200~和\x1b[201~之间，可以整段插入而不是当作按键逐个处理
     //STDIN_FILENO：stdin的文件编号，TCSAFLUSH：改变在所有写入STDIN_FILENO的输出都被传输后生效，
     //所有已接受但未读入的输入都在改变发生前丢弃，即终端不显示输入的字符
 }
@@ -327,7 +1364,7 @@ int get_cursor_position( int* rows, int* cols){
     return -1;
     //n命令用于查询终端的状态信息
   while( ui < sizeof( buf) - 1) {
-    if( read( STDIN_FILENO, &buf[ui], 1) != 1 )
+    if( read_byte_timeout( &buf[ui], 1000) != 1 )
       break;
     if( buf[ui] == 'R')  //到达R退出
       break;
@@ -343,9 +1380,9 @@ int get_cursor_position( int* rows, int* cols){
   return 0;
 }
 
-//得到窗口大小
-int get_window_size( int* rows, int* cols){
-  
+//只用TIOCGWINSZ得到窗口大小，失败返回-1，不向终端写探测序列
+int get_window_size_ioctl( int* rows, int* cols){
+
   struct winsize ws;  //得到窗口大小结构体
 
   //int ioctl(int fildes, int request, ...);
@@ -360,190 +1397,4033 @@ int get_window_size( int* rows, int* cols){
       //EIO: 发生了一些物理 I/O 错误。
       //ENOTTY: fildes 与接受控制功能的设备驱动程序无关。
       //ENXIO: 请求和 arg 参数对此设备驱动程序有效，但请求的服务无法在此特定子设备上执行。
-  if( ioctl( STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0 ){
+  if( ioctl( STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0 || ws.ws_row == 0)
+    return -1;
+  *cols = ws.ws_col;
+  *rows = ws.ws_row;
+  return 0;
+}
+
+//得到窗口大小，只在启动时调用：TIOCGWINSZ不可用时把光标移到右下角再查询光标位置，需要一次和终端的往返
+int get_window_size( int* rows, int* cols){
+  if( get_window_size_ioctl( rows, cols) == -1){
     if( write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12 )
       return -1;
       //C：光标移到右边
       //B：光标移到下面
       //通过C、B，让光标移到右下角，C、B命令赚蒙用于阻止光标越过屏幕
     return get_cursor_position( rows, cols);
-  } else {
-    *cols = ws.ws_col;
-    *rows = ws.ws_row;
-    return 0;
   }
+  return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-/*** row operations ***/
+/*** event loop ***/
+//主循环阻塞在poll上，同时等待标准输入和其他事件源(自管道、以后的文件/定时器描述符)，空闲时不占用CPU
+//信号处理函数和加载线程不直接改屏幕，只向自管道写一个字节把主循环唤醒
 
-void text_update_row( String_row* row) {
-  int tabs = 0;
-  int j = -1;
-  for( j = 0; j < row->size; j++)
-    if( row->one_row_string[j] == '\t')
-      ++tabs;
-
-  free( row->render);
-  row->render = ( char*) malloc( row->size + tabs*( TAB_STOP - 1) + 1); 
-    //tabs最大为8字节，row->size已经为每个tab计数了1，所以*7即可
-
-  int idx = 0;
-  for( j = 0; j < row->size; j++){
-    if( row->one_row_string[j] == '\t'){
-      row->render[idx++] = ' ';
-      while( idx % TAB_STOP != 0)
-        row->render[idx++] = ' ';
-    }else{
-      row->render[idx++] = row->one_row_string[j];
+//在timeout_ms毫秒内从标准输入读一个字节，成功返回1，超时返回0，用于转义序列和终端应答
+int read_byte_timeout( char* c, int timeout_ms){
+  struct pollfd pfd = { STDIN_FILENO, POLLIN, 0};
+  int n;
+  while( ( n = poll( &pfd, 1, timeout_ms)) == -1 && errno == EINTR)
+    TRACE_SYSCALL();
+  TRACE_SYSCALL();
+  if( n <= 0)
+    return 0;
+  ssize_t r = read( STDIN_FILENO, c, 1);
+  TRACE_SYSCALL();
+  if( r == -1 && errno != EAGAIN && errno != EINTR)
+    error_information( "read");
+  return r == 1;
+}
+
+//唤醒主循环，可以在信号处理函数和其他线程中调用
+void event_wake(){
+  int saved_errno = errno;
+  if( text.wake_pipe[1] != -1)
+    write( text.wake_pipe[1], "w", 1);  //管道满时写失败也没关系，主循环已经会被唤醒
+  errno = saved_errno;
+}
+
+//SIGWINCH处理函数：只记下窗口大小改变，真正的处理在主循环中进行
+void handle_sigwinch( int sig){
+  ( void)sig;
+  text.window_changed = 1;
+  event_wake();
+}
+
+//自管道可读：读空管道，处理窗口大小改变
+void event_on_wake( int fd){
+  char buf[64];
+  while( read( fd, buf, sizeof( buf)) > 0)
+    TRACE_SYSCALL();
+  TRACE_SYSCALL();
+  if( text.window_changed){
+    text.window_changed = 0;
+    text_resize();
+  }
+}
+
+//注册一个事件源，fd可读时在主循环中调用on_ready
+void event_add( int fd, void ( *on_ready)( int fd)){
+  if( text.event_count == EVENT_MAX)
+    error_information( "event_add");
+  text.events[text.event_count].fd = fd;
+  text.events[text.event_count].on_ready = on_ready;
+  text.event_count++;
+}
+
+//取消注册fd
+void event_remove( int fd){
+  int i = -1;
+  for( i = 0; i < text.event_count; ++i){
+    if( text.events[i].fd == fd){
+      text.events[i] = text.events[--text.event_count];
+      return;
     }
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
 }
 
-void text_append_row( char* s, size_t len){
-  text.row = realloc( text.row, sizeof( String_row)*(text.number_rows + 1) ); //通过realloc分配内存
-  
-  int rows_ = text.number_rows; //得到当前行号
-  text.row[rows_].size = len; 
-  text.row[rows_].one_row_string = ( char*)malloc( len + 1);
-  memcpy( text.row[rows_].one_row_string, s, len);
-  text.row[rows_].one_row_string[len] = '\0';
-
-  text.row[rows_].rsize = 0;
-  text.row[rows_].render = NULL;
-  text_update_row( &text.row[rows_]);
-  
-  ++text.number_rows;
+//等待事件：标准输入可读返回1；只处理了其他事件返回0；超时返回-1。timeout_ms为-1时一直等待
+int event_wait( int timeout_ms){
+  struct pollfd fds[EVENT_MAX + 1];
+  int i = -1;
+  fds[0].fd = STDIN_FILENO;
+  fds[0].events = POLLIN;
+  for( i = 0; i < text.event_count; ++i){
+    fds[i + 1].fd = text.events[i].fd;
+    fds[i + 1].events = POLLIN;
+  }
+  int n;
+  while( ( n = poll( fds, text.event_count + 1, timeout_ms)) == -1 && errno == EINTR)
+    TRACE_SYSCALL();  //被信号打断，信号处理函数已经写了自管道，重新poll会立即返回，不为此多画一帧
+  TRACE_SYSCALL();
+    //int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+      //等待fds中任意一个描述符就绪，返回就绪的个数，超时返回0
+  if( n == -1)
+    error_information( "poll");
+  if( n == 0)
+    return -1;
+
+  int count = text.event_count;
+  for( i = 0; i < count; ++i)
+    if( fds[i + 1].revents & ( POLLIN | POLLHUP | POLLERR))
+      text.events[i].on_ready( fds[i + 1].fd);
+
+  if( fds[0].revents & POLLIN)
+    return 1;
+  if( fds[0].revents & ( POLLHUP | POLLERR)){ //终端已关闭
+    errno = EIO;
+    error_information( "stdin");
+  }
+  return 0;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//创建自管道，安装SIGWINCH处理函数
+void event_init(){
+  if( pipe2( text.wake_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+    error_information( "pipe");
+  event_add( text.wake_pipe[0], event_on_wake);
 
-/*** file i/o ***/
-//打开读取文件
-void text_open( char* filename){
-  FILE* fp = fopen( filename, "r");
-  if( !fp)
-    error_information("fopen");
-
-  char* line = NULL;
-  size_t linecap = 0;   
-  ssize_t linelen ; //ssize_t与size_t相同，但它是有符号类型,将 ssize_t 读作“有符号 size_t”。
-  while( ( linelen = getline( &line, &linecap, fp)) != -1 ){
-    while( linelen > 0 && ( line[lenlen - 1] == '\n' ||
-                            line[linelen - 1] == '\r' ))
-      linelen--;
-    text_append_row( line, linelen);
-  }
-  free( line);
-  fclose( fp);
+  struct sigaction sa;
+  memset( &sa, 0, sizeof( sa));
+  sa.sa_handler = handle_sigwinch;
+  sigemptyset( &sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if( sigaction( SIGWINCH, &sa, NULL) == -1)
+    error_information( "sigaction");
+}
+
+//窗口大小改变后用TIOCGWINSZ重新得到大小，不再探测终端：查询失败或大小没变(多个SIGWINCH合并、tmux切换窗格)时什么也不做
+//影子缓冲区按屏幕行保留终端上现有的内容，只改变高度时终端保持顶部的内容不动，下一帧只重画内容不同的行：
+//原来的状态栏和消息栏所在的行、新露出的行；宽度改变时终端会截断或重新折行，整屏重画
+void text_resize(){
+  int rows = 0, cols = 0;
+  if( get_window_size_ioctl( &rows, &cols) == -1 || rows < 3)
+    return;
+  if( rows - 2 == text.screen_rows && cols == text.screen_cols)
+    return;
+  int old_count = text.screen_rows + 2, count = rows, i = -1;
+  if( cols != text.screen_cols || text.shadow_cursor_row >= rows)
+    text.shadow_valid = 0;  //光标落到新窗口外时终端会把内容上移
+  for( i = count; i < old_count; ++i)
+    string_buff_free( &text.shadow[i]);
+  text.shadow = realloc( text.shadow, sizeof( struct String_buff) * count);
+  if( text.shadow == NULL)
+    error_information( "realloc");
+  for( i = old_count; i < count; ++i)
+    string_buff_init( &text.shadow[i]); //新露出的行在终端上是空行
+  text.screen_rows = rows - 2;
+  text.screen_cols = cols;
 }
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-/*** input system ***/
+/*** scan kernels ***/
+//扫描内核：找到下一个'\n'，同时汇总这一行的标志(tab、控制字符、非ASCII字节)
+//SSE2每次比较16字节，AVX2每次比较32字节，启动时根据CPU支持情况选择，其他平台使用逐字节版本
 
-//方向键移动光标
-void move_cursor( int key){
-  String_row* row = ( text.cursor_y >= text.number_rows) ? NULL : text.row[text.cursor_y];  
-    //检查光标是否在实际行上
-  
-  if( key == ARROW_UP){ //上箭头 Ctrl-J
-    if( text.cursor_y != 0)
-      --text.cursor_y;
-  } else if( key == ARROW_DOWN){ //下箭头 Ctrl-K
-    if( text.cursor_y < text.number_rows)
-      ++text.cursor_y;
-  } else if( key == ARROW_RIGHT){ //右箭头 Ctrl-L
-    if( row && text.cursor_x < row->size){
-      ++text.cursor_x;
-    } else if( row && text.cursor_x == row->size){
-      ++text.cursor_y;
-      text.cursor_x = 0;
-    }
-  } else if( key == ARROW_LEFT){  //左箭头 Ctrl-H
-    if( text.cursor_x != 0){
-    --text.cursor_x;
-    } else if( row && text.cursor_x > 0){  //左箭头到最前端且非首行时前往上一行末尾
-      --text.cursor_y;
-      text.cursor_x = text.row[text.cursor_y].size;
-    }
+//行尾"\r\n"中的'\r'不算控制字符，其他位置的'\r'算
+unsigned scan_cr_flags( const char* p, const char* q, int crs){
+  if( crs > 1 || ( crs == 1 && !( q > p && q[-1] == '\r')))
+    return ROW_HAS_CTRL;
+  return 0;
+}
+
+//逐字节扫描[q, end)，SIMD版本也用它处理最后不足一组的字节
+const char* scan_bytes( const char* q, const char* end, unsigned* f, int* crs){
+  for( ; q < end && *q != '\n'; ++q){
+    unsigned char c = *q;
+    if( c == '\t')
+      *f |= ROW_HAS_TAB;
+    else if( c == '\r')
+      ++*crs;
+    else if( c < 32 || c == 127)
+      *f |= ROW_HAS_CTRL;
+    else if( c >= 128)
+      *f |= ROW_HAS_HIGH;
   }
-  row = ( text.cursor_y >= text.number_rows) ? NULL : &text.row[text.cursor_y];
-  int row_len = row ? row->size : 0;
-  if( text.cursor_x > row_len)
-    text.cursor_x = row_len;
+  return q;
 }
 
-//从键盘读取字符
-int get_read_from_keyboard() {
-  int read_errno = 0;
-  char c;
+//逐字节版本
+const char* scan_line_end_scalar( const char* p, const char* end, unsigned* flags){
+  unsigned f = 0;
+  int crs = 0;
+  const char* q = scan_bytes( p, end, &f, &crs);
+  *flags = f | scan_cr_flags( p, q, crs);
+  return q;
+}
+
+#if defined( __x86_64__) || defined( __i386__)
 
-  //read()、 STDIN_FILENO都来自 <unistd.h>, 使用read()从标准输入中得到1byte直到没有更多输入  
-  while( (read_errno = read( STDIN_FILENO, &c, 1)) != 1){
-    if( read_errno == -1 && errno != EAGAIN)
-      error_information("read");
+//SSE2版本，x86_64上总是可用
+const char* scan_line_end_sse2( const char* p, const char* end, unsigned* flags){
+  const __m128i nl = _mm_set1_epi8( '\n');
+  const __m128i tab = _mm_set1_epi8( '\t');
+  const __m128i cr = _mm_set1_epi8( '\r');
+  const __m128i space = _mm_set1_epi8( ' ');
+  const __m128i del = _mm_set1_epi8( 127);
+  unsigned f = 0;
+  int crs = 0;
+  const char* q = p;
+  while( end - q >= 16){
+    __m128i v = _mm_loadu_si128( ( const __m128i*)q);
+    unsigned m_nl = _mm_movemask_epi8( _mm_cmpeq_epi8( v, nl));
+    unsigned m_tab = _mm_movemask_epi8( _mm_cmpeq_epi8( v, tab));
+    unsigned m_cr = _mm_movemask_epi8( _mm_cmpeq_epi8( v, cr));
+    unsigned m_high = _mm_movemask_epi8( v); //最高位为1的字节
+    unsigned m_ctrl = _mm_movemask_epi8( _mm_or_si128( _mm_cmplt_epi8( v, space), _mm_cmpeq_epi8( v, del)));
+      //有符号比较，最高位为1的字节也小于32，下面去掉
+    m_ctrl &= ~( m_high | m_tab | m_cr | m_nl);
+    unsigned keep = m_nl ? ( 1u << __builtin_ctz( m_nl)) - 1 : 0xffffu; //只统计换行符之前的字节
+    if( m_tab & keep)
+      f |= ROW_HAS_TAB;
+    if( m_ctrl & keep)
+      f |= ROW_HAS_CTRL;
+    if( m_high & keep)
+      f |= ROW_HAS_HIGH;
+    crs += __builtin_popcount( m_cr & keep);
+    if( m_nl){
+      q += __builtin_ctz( m_nl);
+      *flags = f | scan_cr_flags( p, q, crs);
+      return q;
+    }
+    q += 16;
   }
-  if( c == '\x1b') {
-    char str_[3];
-    if( read( STDIN_FILENO, &str_[0], 1) != 1)
-      return '\x1b';
-    if( read( STDIN_FILENO, &str_[1], 1) != 1)
-      return '\x1b';
-    if( str_[0] == '['){
-      if( str_[1] >= '0' && str_[1] <= '9'){
-        if( read( STDIN_FILENO, &str_[2], 1) != 1)
-          return '\x1b';
-        if( str_[2] == '~'){
-          //Home 键可以作为 <esc>[1~、<esc>[7~、<esc>[H 或 <esc>OH 发送
-          if( str_[1] == '1')
-            return HOME_KEY;
-          //Delete: <esc>[3~
-          else if( str_[1] == '3')
-            return DEL_KEY;
-          //End 键可以作为 <esc>[4~、<esc>[8~、<esc>[F 或 <esc>OF 发送
-          else if( str_[1] == '4')
-            return END_KEY;
-          //Page Up 以 <esc>[5~ 发送，Page Down 以 <esc>[6~ 发送
-          else if( str_[1] == '5')
-            return PAGE_UP;
-          else if( str_[1] == '6')
-            return PAGE_DOWN;
-          else if( str_[1] == '7')
-            return HOME_KEY;
-          else if( str_[1] == '8')  
-            return END_KEY;
-        }
-      } else {
-        if( str_[1] == 'A')
-          return ARROW_UP;
-        else if( str_[1] == 'B')
-          return ARROW_DOWN;
-        else if( str_[1] == 'C')
-          return ARROW_RIGHT;
-        else if( str_[1] == 'D')
-          return ARROW_LEFT;
-        else if( str_[1] == 'H')
-          return HOME_KEY;
-        else if( str_[1] == 'F')         
-          return END_KEY;
-        return '\x1b';
-      }
-    } else if( str_[0] == '0'){
-      if( str_[1] == 'H')
-        return HOME_KEY;
-      else if( str_[1] == 'F')
-        return END_KEY;
+  q = scan_bytes( q, end, &f, &crs);
+  *flags = f | scan_cr_flags( p, q, crs);
+  return q;
+}
+
+//AVX2版本，只有CPU支持时才会被选中
+__attribute__(( target( "avx2")))
+const char* scan_line_end_avx2( const char* p, const char* end, unsigned* flags){
+  const __m256i nl = _mm256_set1_epi8( '\n');
+  const __m256i tab = _mm256_set1_epi8( '\t');
+  const __m256i cr = _mm256_set1_epi8( '\r');
+  const __m256i space = _mm256_set1_epi8( ' ');
+  const __m256i del = _mm256_set1_epi8( 127);
+  unsigned f = 0;
+  int crs = 0;
+  const char* q = p;
+  while( end - q >= 32){
+    __m256i v = _mm256_loadu_si256( ( const __m256i*)q);
+    unsigned m_nl = _mm256_movemask_epi8( _mm256_cmpeq_epi8( v, nl));
+    unsigned m_tab = _mm256_movemask_epi8( _mm256_cmpeq_epi8( v, tab));
+    unsigned m_cr = _mm256_movemask_epi8( _mm256_cmpeq_epi8( v, cr));
+    unsigned m_high = _mm256_movemask_epi8( v);
+    unsigned m_ctrl = _mm256_movemask_epi8( _mm256_or_si256( _mm256_cmpgt_epi8( space, v), _mm256_cmpeq_epi8( v, del)));
+    m_ctrl &= ~( m_high | m_tab | m_cr | m_nl);
+    unsigned keep = m_nl ? ( 1u << __builtin_ctz( m_nl)) - 1 : 0xffffffffu;
+    if( m_tab & keep)
+      f |= ROW_HAS_TAB;
+    if( m_ctrl & keep)
+      f |= ROW_HAS_CTRL;
+    if( m_high & keep)
+      f |= ROW_HAS_HIGH;
+    crs += __builtin_popcount( m_cr & keep);
+    if( m_nl){
+      q += __builtin_ctz( m_nl);
+      *flags = f | scan_cr_flags( p, q, crs);
+      return q;
     }
-  } else
-    return c;
+    q += 32;
+  }
+  q = scan_bytes( q, end, &f, &crs);
+  *flags = f | scan_cr_flags( p, q, crs);
+  return q;
 }
 
-//input system
+#endif
+
+//根据CPU支持情况选择扫描内核和搜索内核
+void scan_init(){
+  scan_line_end = scan_line_end_scalar;
+  scan_kernel_name = "scalar";
+  search_memmem = search_memmem_libc;
+#if defined( __x86_64__) || defined( __i386__)
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports( "avx2")){
+    scan_line_end = scan_line_end_avx2;
+    scan_kernel_name = "avx2";
+    search_memmem = search_memmem_avx2;
+  } else if( __builtin_cpu_supports( "sse2")){
+    scan_line_end = scan_line_end_sse2;
+    scan_kernel_name = "sse2";
+  }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*** line index ***/
+//原始行的索引按块存放，块一旦分配就不再移动，加载线程追加新块时主线程可以同时读取已发布的部分
+//加载线程每扫描一批行后用release写入loaded_lines发布，主线程用acquire读取，只访问已发布的行，不需要加锁
+
+//保证文件f的第line行所在的块已分配，只由加载线程调用
+void line_chunk_ensure( Text_file* f, int line){
+  int c = line >> LINE_CHUNK_SHIFT;
+  if( f->line_chunks[c] == NULL){
+    f->line_chunks[c] = malloc( sizeof( Line_chunk));
+    if( f->line_chunks[c] == NULL)
+      error_information( "malloc");
+  }
+}
+
+//行尾"\n"或"\r\n"的字节数
+int line_eol_len( unsigned flags){
+  return ( flags & ROW_EOL_CR) ? 2 : ( flags & ROW_EOL_LF) ? 1 : 0;
+}
+
+//第line个原始行的起始偏移，第line_count个是最后一行的结尾
+//从所在组的起始偏移加上组内前面各行的长度，最多累加LINE_GROUP-1行
+size_t line_start_at( int line){
+  Line_chunk* c = text.buf->line_chunks[line >> LINE_CHUNK_SHIFT];
+  int i = line & ( LINE_CHUNK - 1);
+  int g = i & ~( LINE_GROUP - 1);
+  size_t start = c->group_start[g >> LINE_GROUP_SHIFT];
+  for( ; g < i; ++g)
+    start += c->len[g] + line_eol_len( c->flags[g]);
+  return start;
+}
+
+//第line个原始行的长度，不访问文件内容
+int line_len_at( int line){
+  return text.buf->line_chunks[line >> LINE_CHUNK_SHIFT]->len[line & ( LINE_CHUNK - 1)];
+}
+
+//第line个原始行的行标志
+unsigned line_flags_at( int line){
+  return text.buf->line_chunks[line >> LINE_CHUNK_SHIFT]->flags[line & ( LINE_CHUNK - 1)];
+}
+
+//从q开始扫描一行，得到内容的长度(不含行尾)和行标志，返回下一行的开始
+const char* line_scan( const char* q, const char* end, int* len, unsigned* flags_out){
+  unsigned flags = 0;
+  const char* nl = scan_line_end( q, end, &flags);
+  const char* e = nl; //本行内容的结尾
+  const char* next = nl;  //下一行的开始
+  if( nl - q > LINE_LEN_MAX){
+    e = next = q + LINE_LEN_MAX;
+  } else if( nl < end){
+    next = nl + 1;
+    flags |= ROW_EOL_LF;
+    if( e > q && e[-1] == '\r'){
+      --e;
+      flags |= ROW_EOL_CR;
+    }
+  } else if( e > q && e[-1] == '\r'){
+    flags |= ROW_HAS_CTRL;  //文件末尾没有'\n'时最后的'\r'不是行尾
+  }
+  *len = e - q;
+  *flags_out = flags;
+  return next;
+}
+
+//为文件f的第line行建立索引：从q开始扫描一行，记下长度和行标志，返回下一行的开始
+//加载线程和跟随文件时的主线程共用，调用者保证没有别的线程同时写f的行索引
+const char* line_index_next( Text_file* f, int line, const char* q, const char* end){
+  int len = 0;
+  unsigned flags = 0;
+  const char* next = line_scan( q, end, &len, &flags);
+  Line_chunk* c = f->line_chunks[line >> LINE_CHUNK_SHIFT];
+  c->len[line & ( LINE_CHUNK - 1)] = len;
+  c->flags[line & ( LINE_CHUNK - 1)] = flags;
+  ++line;
+  line_chunk_ensure( f, line);
+  if( ( line & ( LINE_GROUP - 1)) == 0)
+    f->line_chunks[line >> LINE_CHUNK_SHIFT]->group_start[( line & ( LINE_CHUNK - 1)) >> LINE_GROUP_SHIFT] = next - f->map;
+    //先写好下一组的起始位置，这样已发布的每一行都能算出结尾
+  return next;
+}
+
+//加载线程：从f->load_off开始扫描到文件末尾建立行索引，按批发布，批的大小从64行开始翻倍，让第一屏尽快显示
+void* text_loader( void* arg){
+  Text_file* f = arg;
+  const char* end = f->map + f->map_size;
+  const char* q = f->map + f->load_off;
+  int count = f->loaded_lines;  //跟随文件时接着已有的行继续
+  int published = count;
+  int batch = 64;
+
+  line_chunk_ensure( f, count);
+  if( count == 0)
+    f->line_chunks[0]->group_start[0] = 0;
+  while( q < end && !__atomic_load_n( &f->load_stop, __ATOMIC_RELAXED)){
+    q = line_index_next( f, count, q, end);
+    ++count;
+    if( count - published >= batch){
+      if( f->index_fd != -1)
+        index_cache_write( f, published, count); //发布之前写，发布后主线程会改行标志中的高亮状态
+      __atomic_store_n( &f->loaded_lines, count, __ATOMIC_RELEASE);
+      event_wake();  //唤醒主循环显示新加载的行
+      published = count;
+      if( batch < LINE_CHUNK)
+        batch *= 2;
+    }
+  }
+  f->load_off = q - f->map;
+  if( f->index_fd != -1){
+    index_cache_write( f, published, count);
+    index_cache_finish( f, count, q < end);
+  }
+  __atomic_store_n( &f->loaded_lines, count, __ATOMIC_RELEASE);
+  __atomic_store_n( &f->load_done, 1, __ATOMIC_RELEASE);
+  event_wake();
+  return NULL;
+}
+
+//从f->loaded_lines行、f->load_off字节处启动加载线程
+void text_load_continue( Text_file* f){
+  f->load_done = 0;
+  f->load_stop = 0;
+  if( pthread_create( &f->loader, NULL, text_loader, f) != 0)
+    error_information( "pthread_create");
+  f->loader_joined = 0;
+}
+
+//为已读入的f->map建立块目录并启动加载线程
+void text_load_start( Text_file* f){
+  f->line_chunk_count = ( f->map_size + 1) / LINE_CHUNK + 2; //行数不会超过字节数+1
+  f->line_chunks = calloc( f->line_chunk_count, sizeof( Line_chunk*));
+  if( f->line_chunks == NULL)
+    error_information( "calloc");
+  f->loaded_lines = 0;
+  f->load_off = 0;
+  if( f->index_path)
+    index_cache_begin( f);
+  text_load_continue( f);
+}
+
+//主线程调用：把加载线程新发布的行接到当前缓冲区的片段树末尾，加载完成后回收线程
+//共享同一个文件的其他缓冲区在切换过去后的第一帧一次接上所有已发布的行
+void text_load_sync(){
+  Text_file* f = text.buf->file;
+  if( f == NULL)
+    return;
+  if( text.buf->appends != f->appends){
+    //文件追加了内容：映射和块目录可能已经移动，原来没有行尾的最后一行可能变长了
+    if( text.buf->row_cache){
+      if( text.buf->map != f->map)
+        row_cache_reset();
+      else if( text.buf->line_count > 0)
+        row_cache_drop( text.buf->line_count - 1);
+    }
+    if( text.buf->hl_private && text.buf->number_rows > 0 && text.buf->number_rows - 1 < text.buf->hl_dirty)
+      text.buf->hl_dirty = text.buf->number_rows - 1;
+    if( text.buf->hl_lines && text.buf->hl_line_count < f->line_chunk_count){ //块目录变大了，高亮状态的目录跟着加长
+      unsigned char** hl = realloc( text.buf->hl_lines, sizeof( unsigned char*) * f->line_chunk_count);
+      if( hl == NULL)
+        error_information( "realloc");
+      memset( hl + text.buf->hl_line_count, 0, sizeof( unsigned char*) * ( f->line_chunk_count - text.buf->hl_line_count));
+      text.buf->hl_lines = hl;
+      text.buf->hl_line_count = f->line_chunk_count;
+    }
+    text.buf->map = f->map;
+    text.buf->map_size = f->map_size;
+    text.buf->line_chunks = f->line_chunks;
+    text.buf->appends = f->appends;
+    text.buf->index_done = 0;
+  }
+  if( text.buf->index_done)
+    return;
+  int done = __atomic_load_n( &f->load_done, __ATOMIC_ACQUIRE);
+  int lines = __atomic_load_n( &f->loaded_lines, __ATOMIC_ACQUIRE);
+  if( lines > text.buf->line_count){
+    int tail = f->follow && text.buf->cursor_y >= text.buf->number_rows - 1;  //跟随文件且光标在最后一行时跟着新内容走
+    piece_append_original( text.buf->line_count, lines - text.buf->line_count);
+    text.buf->line_count = lines;
+    if( tail && text.buf->cursor_y != text.buf->number_rows - 1){
+      text.buf->cursor_y = text.buf->number_rows - 1;
+      text.buf->cursor_x = 0;
+    }
+  }
+  if( done){
+    if( !f->loader_joined)
+      pthread_join( f->loader, NULL);
+    f->loader_joined = 1;
+    text.buf->index_done = 1;
+  }
+}
+
+//已加载的字节占文件的百分比
+int text_load_percent(){
+  if( text.buf->map_size == 0 || text.buf->line_count == 0)
+    return 0;
+  return ( int)( line_start_at( text.buf->line_count) * 100 / text.buf->map_size);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*** index cache ***/
+//大文件扫描完后把行索引写进缓存目录中的一个文件，再打开同一个文件时直接映射它，不再扫描
+//缓存按文件的绝对路径命名，文件头记下长度、修改时间和抽样内容的哈希，有一项不同就完整扫描并重写缓存
+//打开时只检查文件头；行第一次实体化时顺便重新扫描这一行，发现不符时删掉缓存，下一帧重新打开文件
+//缓存默认关闭，设置KILO_INDEX_CACHE后才使用，见index_cache_dir
+
+//FNV-1a哈希
+uint64_t index_fnv( uint64_t h, const void* p, size_t n){
+  const unsigned char* b = p;
+  while( n--){
+    h ^= *b++;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+//均匀抽取文件中的INDEX_SAMPLES块计算哈希，只读几页，捕捉长度和修改时间都没变的改动
+uint64_t index_sample_hash( const char* map, size_t size){
+  uint64_t h = index_fnv( 14695981039346656037ull, &size, sizeof( size));
+  size_t n = size < INDEX_SAMPLE_BYTES ? size : INDEX_SAMPLE_BYTES;
+  int i = -1;
+  for( i = 0; i < INDEX_SAMPLES; ++i)
+    h = index_fnv( h, map + ( size - n) / ( INDEX_SAMPLES - 1) * i, n);
+  return h;
+}
+
+//缓存目录：缓存要设置环境变量KILO_INDEX_CACHE才使用，没有设置或为0时返回NULL
+//KILO_INDEX_CACHE为1时用$XDG_CACHE_HOME/kilo或~/.cache/kilo，其他值是缓存目录
+char* index_cache_dir(){
+  const char* env = getenv( "KILO_INDEX_CACHE");
+  const char* base = getenv( "XDG_CACHE_HOME");
+  const char* home = getenv( "HOME");
+  char dir[PATH_MAX];
+  if( env == NULL || env[0] == '\0' || strcmp( env, "0") == 0)
+    return NULL;  //缓存会在用户目录中写文件，默认不使用
+  if( strcmp( env, "1") != 0){
+    snprintf( dir, sizeof( dir), "%s", env);
+  } else if( base && base[0]){
+    snprintf( dir, sizeof( dir), "%s/kilo", base);
+  } else if( home && home[0]){
+    snprintf( dir, sizeof( dir), "%s/.cache", home);
+    mkdir( dir, 0700);
+    snprintf( dir, sizeof( dir), "%s/.cache/kilo", home);
+  } else {
+    return NULL;
+  }
+  if( mkdir( dir, 0700) == -1 && errno != EEXIST)
+    return NULL;
+  return strdup( dir);
+}
+
+//映射缓存文件：文件头和文件的长度、修改时间、路径、抽样哈希都相同时，行索引的块直接指向映射，成功时返回1
+int index_cache_load( Text_file* f){
+  int fd = open( f->index_path, O_RDONLY);
+  if( fd == -1)
+    return 0;
+  struct stat st;
+  Index_header h;
+  size_t path_len = strlen( f->index_key);
+  char path[INDEX_DATA_OFF];
+  int ok = fstat( fd, &st) == 0 && pread( fd, &h, sizeof( h), 0) == ( ssize_t)sizeof( h)
+    && memcmp( h.magic, "KILOIDX1", 8) == 0 && h.chunk_lines == LINE_CHUNK && h.chunk_bytes == sizeof( Line_chunk)
+    && h.size == f->map_size && h.mtime_sec == f->mtime.tv_sec && h.mtime_nsec == f->mtime.tv_nsec
+    && h.hash == f->index_hash && h.lines > 0 && h.lines <= f->map_size + 1 && h.lines < INT_MAX
+    && h.path_len == path_len && sizeof( h) + path_len <= INDEX_DATA_OFF
+    && pread( fd, path, path_len, sizeof( h)) == ( ssize_t)path_len && memcmp( path, f->index_key, path_len) == 0
+    && ( size_t)st.st_size == INDEX_DATA_OFF + ( ( h.lines >> LINE_CHUNK_SHIFT) + 1) * sizeof( Line_chunk);
+  char* m = ok ? mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    //私有映射：跟随文件时追加的行和高亮状态写在复制出的页上，不改缓存文件
+  close( fd);
+  if( m == MAP_FAILED)
+    return 0;
+
+  f->line_chunk_count = ( f->map_size + 1) / LINE_CHUNK + 2;
+  f->line_chunks = calloc( f->line_chunk_count, sizeof( Line_chunk*));
+  if( f->line_chunks == NULL)
+    error_information( "calloc");
+  size_t i = 0;
+  for( i = 0; i <= h.lines >> LINE_CHUNK_SHIFT; ++i)
+    f->line_chunks[i] = ( Line_chunk*)( m + INDEX_DATA_OFF + i * sizeof( Line_chunk));
+  f->index_map = m;
+  f->index_map_size = st.st_size;
+  f->loaded_lines = h.lines;
+  f->load_off = f->map_size;
+  f->load_done = 1;
+  f->index_cached = 1;
+  return 1;
+}
+
+//text_open调用：足够大的文件确定缓存文件的位置，有可用的缓存时直接得到行索引
+void index_cache_open( Text_file* f, const char* filename){
+  if( f->map_size < INDEX_CACHE_MIN)
+    return;
+  char* dir = index_cache_dir();
+  char* key = realpath( filename, NULL);
+  if( dir == NULL || key == NULL){
+    free( dir);
+    free( key);
+    return;
+  }
+  size_t n = strlen( dir) + 32;
+  f->index_path = malloc( n);
+  if( f->index_path == NULL)
+    error_information( "malloc");
+  snprintf( f->index_path, n, "%s/%016llx.idx", dir, ( unsigned long long)index_fnv( 14695981039346656037ull, key, strlen( key)));
+  free( dir);
+  f->index_key = key;
+  f->index_hash = index_sample_hash( f->map, f->map_size);
+  index_cache_load( f);
+}
+
+//完整扫描开始时打开临时文件，其他进程同时写同一个缓存时互不影响
+void index_cache_begin( Text_file* f){
+  size_t n = strlen( f->index_path) + 32;
+  f->index_tmp = malloc( n);
+  if( f->index_tmp == NULL)
+    error_information( "malloc");
+  snprintf( f->index_tmp, n, "%s.%d", f->index_path, ( int)getpid());
+  f->index_fd = open( f->index_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+}
+
+//放弃这次写缓存，不影响加载
+void index_cache_abort( Text_file* f){
+  close( f->index_fd);
+  unlink( f->index_tmp);
+  f->index_fd = -1;
+}
+
+//写一段，失败时放弃缓存，返回0
+int index_cache_pwrite( Text_file* f, const void* p, size_t n, off_t off){
+  if( pwrite( f->index_fd, p, n, off) == ( ssize_t)n)
+    return 1;
+  index_cache_abort( f);
+  return 0;
+}
+
+//加载线程调用：发布[from, to)行之前把它们的长度、行标志和组起始位置写到缓存文件中块的对应位置
+void index_cache_write( Text_file* f, int from, int to){
+  while( from < to && f->index_fd != -1){
+    int i = from & ( LINE_CHUNK - 1);
+    int n = to - from < LINE_CHUNK - i ? to - from : LINE_CHUNK - i;
+    Line_chunk* c = f->line_chunks[from >> LINE_CHUNK_SHIFT];
+    off_t base = INDEX_DATA_OFF + ( off_t)( from >> LINE_CHUNK_SHIFT) * sizeof( Line_chunk);
+    int g = i >> LINE_GROUP_SHIFT, g_end = ( ( i + n - 1) >> LINE_GROUP_SHIFT) + 1;
+    if( index_cache_pwrite( f, &c->len[i], n * sizeof( uint32_t), base + offsetof( Line_chunk, len) + i * sizeof( uint32_t))
+      && index_cache_pwrite( f, &c->flags[i], n, base + offsetof( Line_chunk, flags) + i))
+      index_cache_pwrite( f, &c->group_start[g], ( g_end - g) * sizeof( uint64_t), base + offsetof( Line_chunk, group_start) + g * sizeof( uint64_t));
+    from += n;
+  }
+}
+
+//加载线程扫描到文件末尾后调用：写好最后一行结尾所在的组起始位置和文件头，改名为正式的缓存文件；扫描被打断时删掉
+void index_cache_finish( Text_file* f, int lines, int stopped){
+  if( f->index_fd == -1)
+    return;
+  if( stopped){
+    index_cache_abort( f);
+    return;
+  }
+  Line_chunk* c = f->line_chunks[lines >> LINE_CHUNK_SHIFT];
+  int g = ( lines & ( LINE_CHUNK - 1)) >> LINE_GROUP_SHIFT;
+  off_t base = INDEX_DATA_OFF + ( off_t)( lines >> LINE_CHUNK_SHIFT) * sizeof( Line_chunk);
+  Index_header h;
+  memset( &h, 0, sizeof( h));
+  memcpy( h.magic, "KILOIDX1", 8);
+  h.chunk_lines = LINE_CHUNK;
+  h.chunk_bytes = sizeof( Line_chunk);
+  h.size = f->map_size;
+  h.mtime_sec = f->mtime.tv_sec;
+  h.mtime_nsec = f->mtime.tv_nsec;
+  h.hash = f->index_hash;
+  h.lines = lines;
+  h.path_len = strlen( f->index_key);
+  if( sizeof( h) + h.path_len > INDEX_DATA_OFF){
+    index_cache_abort( f);
+    return;
+  }
+  if( !index_cache_pwrite( f, &c->group_start[g], sizeof( uint64_t), base + offsetof( Line_chunk, group_start) + g * sizeof( uint64_t))
+    || !index_cache_pwrite( f, f->index_key, h.path_len, sizeof( h))
+    || !index_cache_pwrite( f, &h, sizeof( h), 0))
+    return;
+  if( ftruncate( f->index_fd, base + sizeof( Line_chunk)) == -1 || rename( f->index_tmp, f->index_path) == -1){
+    index_cache_abort( f);
+    return;
+  }
+  close( f->index_fd);
+  f->index_fd = -1;
+}
+
+//实体化来自缓存的原始行时重新扫描这一行(反正要显示)，长度、行标志或下一行的开始不符说明文件在写缓存后被改过
+//只由text_row_view调用，f是当前缓冲区的文件
+void index_cache_check( Text_file* f, int line){
+  int len = 0;
+  unsigned flags = 0;
+  size_t start = line_start_at( line);
+  size_t next = line_start_at( line + 1);
+  if( start <= next && next <= f->map_size){
+    const char* q = line_scan( f->map + start, f->map + f->map_size, &len, &flags);
+    if( len == line_len_at( line) && flags == ( line_flags_at( line) & ~( ROW_HL_KNOWN | ROW_HL_COMMENT))
+      && ( size_t)( q - f->map) == next)
+      return;
+  }
+  f->index_stale = 1;
+  f->shared = 0;  //重新打开时不能再共享这个文件
+  unlink( f->index_path);
+}
+
+//每帧开始时处理缓存过时的文件：没有编辑过的缓冲区重新打开，完整扫描
+void index_cache_sync(){
+  Text_file* f = text.files;
+  int i = -1;
+  while( f && !f->index_stale)
+    f = f->next;
+  if( f == NULL || save.running || search.shard_count > 0 || grep.active)
+    return;
+  f->index_stale = 0;
+  f->index_cached = 0;
+  for( i = 0; i < text.buffer_count; ++i){
+    struct Text_buffer* b = text.buffers[i];
+    if( b->file == f && buffer_edited( b)){
+      snprintf( text.message, sizeof( text.message), "%.60s changed since its line index was cached, reopen it", b->filename);
+      return;
+    }
+  }
+  follow_reload( f, "changed since its line index was cached");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*** piece table ***/
+//所有行保存在一棵按行号组织的treap中，查找、插入、删除一行都是O(log n)
+//未修改的行只在ORIGINAL片段中记录原始行号范围，与文件映射共享内容
+
+//新建一个片段
+Row_piece* piece_new( int first, int lines, String_row* row){
+  Row_piece* p = arena_alloc( &text.buf->arena, sizeof( Row_piece));
+  p->left = p->right = NULL;
+  p->priority = ( unsigned int)rand();
+  p->first = first;
+  p->lines = lines;
+  p->count = lines;
+  p->row = row;
+  return p;
+}
+
+//重新计算子树行数
+void piece_update( Row_piece* p){
+  p->count = p->lines;
+  if( p->left)
+    p->count += p->left->count;
+  if( p->right)
+    p->count += p->right->count;
+}
+
+//合并两棵树，a中所有行都在b之前
+Row_piece* piece_merge( Row_piece* a, Row_piece* b){
+  if( !a)
+    return b;
+  if( !b)
+    return a;
+  if( a->priority >= b->priority){
+    a->right = piece_merge( a->right, b);
+    piece_update( a);
+    return a;
+  }
+  b->left = piece_merge( a, b->left);
+  piece_update( b);
+  return b;
+}
+
+//把树t拆成前k行(*l)和剩下的行(*r)，k落在某个片段内部时把片段一分为二
+void piece_split( Row_piece* t, int k, Row_piece** l, Row_piece** r){
+  if( !t){
+    *l = *r = NULL;
+    return;
+  }
+  int left_count = t->left ? t->left->count : 0;
+  if( k <= left_count){
+    piece_split( t->left, k, l, &t->left);
+    piece_update( t);
+    *r = t;
+  } else if( k >= left_count + t->lines){
+    piece_split( t->right, k - left_count - t->lines, &t->right, r);
+    piece_update( t);
+    *l = t;
+  } else {
+    //只有ORIGINAL片段会超过一行，后半段用新的随机优先级和原来的右子树合并
+    //(后半段若沿用原优先级，连续编辑后大量节点优先级相同，treap会退化成链表)
+    int off = k - left_count;
+    Row_piece* tail = piece_new( t->first + off, t->lines - off, NULL);
+    Row_piece* right = t->right;
+    t->right = NULL;
+    t->lines = off;
+    piece_update( t);
+    *l = t;
+    *r = piece_merge( tail, right);
+  }
+}
+
+//释放一棵树及ADDED片段持有的行
+void piece_free( Row_piece* t){
+  if( !t)
+    return;
+  piece_free( t->left);
+  piece_free( t->right);
+  if( t->row)
+    text_row_free( t->row);
+  arena_free( &text.buf->arena, t, sizeof( Row_piece));
+}
+
+//找到第at行所在片段，*off为该行在片段内的偏移
+Row_piece* piece_find( int at, int* off){
+  Row_piece* t = text.buf->rows;
+  while( t){
+    int left_count = t->left ? t->left->count : 0;
+    if( at < left_count){
+      t = t->left;
+    } else if( at < left_count + t->lines){
+      *off = at - left_count;
+      return t;
+    } else {
+      at -= left_count + t->lines;
+      t = t->right;
+    }
+  }
+  return NULL;
+}
+
+//新索引的原始行[first, first+n)接在末尾，若最后一个片段正好在first前结束则直接扩展它
+void piece_append_original( int first, int n){
+  Row_piece* t = text.buf->rows;
+  Row_piece* last = NULL;
+  while( t){
+    last = t;
+    t = t->right;
+  }
+  if( last && !last->row && last->first + last->lines == first){
+    for( t = text.buf->rows; t; t = t->right)
+      t->count += n;
+    last->lines += n;
+  } else {
+    text.buf->rows = piece_merge( text.buf->rows, piece_new( first, n, NULL));
+  }
+  text.buf->number_rows += n;
+}
+
+//原始行line在map中的范围，不含行尾的"\r\n"
+void text_line_span( int line, size_t* start, size_t* end){
+  *start = line_start_at( line);
+  *end = *start + line_len_at( line);
+}
+
+//把缓存项i从LRU链表中摘下
+void row_cache_unlink( int i){
+  Row_cache_entry* e = &text.buf->row_cache[i];
+  if( e->prev != -1)
+    text.buf->row_cache[e->prev].next = e->next;
+  else
+    text.buf->lru_head = e->next;
+  if( e->next != -1)
+    text.buf->row_cache[e->next].prev = e->prev;
+  else
+    text.buf->lru_tail = e->prev;
+}
+
+//把缓存项i放到LRU链表头
+void row_cache_push_front( int i){
+  Row_cache_entry* e = &text.buf->row_cache[i];
+  e->prev = -1;
+  e->next = text.buf->lru_head;
+  if( text.buf->lru_head != -1)
+    text.buf->row_cache[text.buf->lru_head].prev = i;
+  text.buf->lru_head = i;
+  if( text.buf->lru_tail == -1)
+    text.buf->lru_tail = i;
+}
+
+//把缓存项i从它所在的哈希桶中移除
+void row_cache_unhash( int i){
+  int* p = &text.buf->row_bucket[text.buf->row_cache[i].line & ( ROW_CACHE_BUCKETS - 1)];
+  while( *p != i)
+    p = &text.buf->row_cache[*p].hash_next;
+  *p = text.buf->row_cache[i].hash_next;
+}
+
+//清空未修改行的缓存，文件映射改变时调用
+void row_cache_reset(){
+  int i = -1;
+  for( i = 0; i < ROW_CACHE_BUCKETS; ++i)
+    text.buf->row_bucket[i] = -1;
+  text.buf->lru_head = text.buf->lru_tail = -1;
+  for( i = 0; i < ROW_CACHE_SIZE; ++i){
+    text_update_row( &text.buf->row_cache[i].row);
+    text.buf->row_cache[i].line = -1;
+    row_cache_push_front( i);
+  }
+}
+
+//把原始行line从缓存中去掉，跟随的文件最后一行变长时调用
+void row_cache_drop( int line){
+  int i = text.buf->row_bucket[line & ( ROW_CACHE_BUCKETS - 1)];
+  while( i != -1 && text.buf->row_cache[i].line != line)
+    i = text.buf->row_cache[i].hash_next;
+  if( i == -1)
+    return;
+  row_cache_unhash( i);
+  text_update_row( &text.buf->row_cache[i].row);
+  text.buf->row_cache[i].line = -1;
+}
+
+//未修改的原始行第一次滚动到可见区域时才实体化并放入缓存，缓存满时淘汰最久没用的一项
+String_row* text_row_view( int line){
+  int i = text.buf->row_bucket[line & ( ROW_CACHE_BUCKETS - 1)];
+  while( i != -1 && text.buf->row_cache[i].line != line)
+    i = text.buf->row_cache[i].hash_next;
+  if( i != -1){
+    row_cache_unlink( i);
+    row_cache_push_front( i);
+    return &text.buf->row_cache[i].row;
+  }
+
+  i = text.buf->lru_tail;
+  Row_cache_entry* e = &text.buf->row_cache[i];
+  if( e->line != -1)
+    row_cache_unhash( i);
+  row_cache_unlink( i);
+
+  if( text.buf->file && text.buf->file->index_cached && !text.buf->file->index_stale)
+    index_cache_check( text.buf->file, line);
+  size_t start, end;
+  text_line_span( line, &start, &end);
+  if( end > text.buf->map_size) //缓存的行索引和文件不符，这一帧先显示为空行
+    start = end = text.buf->map_size;
+  e->row.size = end - start;
+  e->row.one_row_string = text.buf->map + start;  //直接指向映射，不复制
+  text_update_row( &e->row);  //列检查点等到绘制时才计算
+  e->row.flags = line_flags_at( line);
+  e->line = line;
+  e->hash_next = text.buf->row_bucket[line & ( ROW_CACHE_BUCKETS - 1)];
+  text.buf->row_bucket[line & ( ROW_CACHE_BUCKETS - 1)] = i;
+  row_cache_push_front( i);
+  return &e->row;
+}
+
+//得到第at行，未修改的行返回缓存中的实体，指针在缓存项被淘汰前有效
+String_row* text_row_at( int at){
+  int off = 0;
+  Row_piece* p = piece_find( at, &off);
+  if( p->row)
+    return p->row;
+  return text_row_view( p->first + off);
+}
+
+//第at行的长度，只查索引不实体化，移动光标时使用
+int text_row_size( int at){
+  int off = 0;
+  Row_piece* p = piece_find( at, &off);
+  return p->row ? p->row->size : line_len_at( p->first + off);
+}
+
+//第at行的行标志，只查索引不实体化
+unsigned text_row_flags( int at){
+  int off = 0;
+  Row_piece* p = piece_find( at, &off);
+  return p->row ? p->row->flags : line_flags_at( p->first + off);
+}
+
+//新建一个持有内容的行，内容放在增长池中
+String_row* text_row_new( const char* s, size_t len){
+  String_row* row = arena_alloc( &text.buf->arena, sizeof( String_row));
+  row->size = len;
+  row->cap = arena_round( len + 1);
+  row->one_row_string = arena_alloc( &text.buf->grow, row->cap);
+  memcpy( row->one_row_string, s, len);
+  row->one_row_string[len] = '\0';
+  row->col_marks = NULL;
+  row->col_mark_count = 0;
+  row->col_mark_cap = 0;
+  row->flags = ROW_FLAGS_UNKNOWN;
+  row->hl_state = HL_UNKNOWN;
+  return row;
+}
+
+//释放text_row_new得到的行
+void text_row_free( String_row* row){
+  text_update_row( row);
+  arena_free( &text.buf->grow, row->one_row_string, row->cap);
+  arena_free( &text.buf->arena, row, sizeof( String_row));
+}
+
+//保证行的内容还能容纳need字节，容量不够时至少翻倍，连续输入时不会每个字符都复制一次
+void text_row_reserve( String_row* row, size_t need){
+  if( need <= ( size_t)row->cap)
+    return;
+  size_t cap = ( size_t)row->cap * 2 > need ? ( size_t)row->cap * 2 : need;
+  cap = arena_round( cap);
+  row->one_row_string = arena_realloc( &text.buf->grow, row->one_row_string, row->cap, cap);
+  row->cap = cap;
+}
+
+//得到第at行的可修改版本，原始行第一次修改时复制出来，变成单独的ADDED片段
+String_row* text_row_edit( int at){
+  hl_mark_dirty( at);
+  int off = 0;
+  Row_piece* p = piece_find( at, &off);
+  if( p->row)
+    return p->row;
+
+  size_t start, end;
+  text_line_span( p->first + off, &start, &end);
+  Row_piece *l, *m, *r;
+  piece_split( text.buf->rows, at, &l, &r);
+  piece_split( r, 1, &m, &r);
+  m->row = text_row_new( text.buf->map + start, end - start);
+  m->first = -1;
+  text.buf->rows = piece_merge( piece_merge( l, m), r);
+  return m->row;
+}
+
+//在第at行前插入一行
+void text_row_insert( int at, const char* s, size_t len){
+  hl_mark_dirty( at);
+  Row_piece *l, *r;
+  piece_split( text.buf->rows, at, &l, &r);
+  text.buf->rows = piece_merge( piece_merge( l, piece_new( -1, 1, text_row_new( s, len))), r);
+  ++text.buf->number_rows;
+}
+
+//删除第at行
+void text_row_delete( int at){
+  hl_mark_dirty( at);
+  Row_piece *l, *m, *r;
+  piece_split( text.buf->rows, at, &l, &r);
+  piece_split( r, 1, &m, &r);
+  piece_free( m);
+  text.buf->rows = piece_merge( l, r);
+  --text.buf->number_rows;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*** utf-8 ***/
+//行中的位置仍然按字节计算，只在含有非ASCII字节(ROW_HAS_HIGH，建索引时由扫描内核得到)的行中才解码
+//纯ASCII的行完全不经过这里；显示宽度按东亚宽度表计算，结果缓存在行的列检查点中
+
+//显示宽度为2的码位范围(东亚宽字符和全角字符、emoji)，按起点排序
+static const unsigned utf8_wide[][2] = {
+  { 0x1100, 0x115F}, { 0x231A, 0x231B}, { 0x2329, 0x232A}, { 0x23E9, 0x23EC}, { 0x23F0, 0x23F0},
+  { 0x23F3, 0x23F3}, { 0x25FD, 0x25FE}, { 0x2614, 0x2615}, { 0x2648, 0x2653}, { 0x267F, 0x267F},
+  { 0x2693, 0x2693}, { 0x26A1, 0x26A1}, { 0x26AA, 0x26AB}, { 0x26BD, 0x26BE}, { 0x26C4, 0x26C5},
+  { 0x26CE, 0x26CE}, { 0x26D4, 0x26D4}, { 0x26EA, 0x26EA}, { 0x26F2, 0x26F3}, { 0x26F5, 0x26F5},
+  { 0x26FA, 0x26FA}, { 0x26FD, 0x26FD}, { 0x2705, 0x2705}, { 0x270A, 0x270B}, { 0x2728, 0x2728},
+  { 0x274C, 0x274C}, { 0x274E, 0x274E}, { 0x2753, 0x2755}, { 0x2757, 0x2757}, { 0x2795, 0x2797},
+  { 0x27B0, 0x27B0}, { 0x27BF, 0x27BF}, { 0x2B1B, 0x2B1C}, { 0x2B50, 0x2B50}, { 0x2B55, 0x2B55},
+  { 0x2E80, 0x303E}, { 0x3041, 0x33FF}, { 0x3400, 0x4DBF}, { 0x4E00, 0x9FFF}, { 0xA000, 0xA4CF},
+  { 0xA960, 0xA97F}, { 0xAC00, 0xD7A3}, { 0xF900, 0xFAFF}, { 0xFE10, 0xFE19}, { 0xFE30, 0xFE6F},
+  { 0xFF00, 0xFF60}, { 0xFFE0, 0xFFE6}, { 0x16FE0, 0x16FE4}, { 0x17000, 0x18CFF}, { 0x1B000, 0x1B2FF},
+  { 0x1F004, 0x1F004}, { 0x1F0CF, 0x1F0CF}, { 0x1F18E, 0x1F18E}, { 0x1F191, 0x1F19A}, { 0x1F200, 0x1F251},
+  { 0x1F300, 0x1F64F}, { 0x1F680, 0x1F6FF}, { 0x1F7E0, 0x1F7EB}, { 0x1F90C, 0x1F9FF}, { 0x1FA70, 0x1FAFF},
+  { 0x20000, 0x2FFFD}, { 0x30000, 0x3FFFD}
+};
+
+//显示宽度为0的码位范围(组合字符、零宽字符)
+static const unsigned utf8_zero[][2] = {
+  { 0x0300, 0x036F}, { 0x0483, 0x0489}, { 0x0591, 0x05BD}, { 0x0610, 0x061A}, { 0x064B, 0x065F},
+  { 0x0E31, 0x0E31}, { 0x0E34, 0x0E3A}, { 0x0E47, 0x0E4E}, { 0x1AB0, 0x1AFF}, { 0x1DC0, 0x1DFF},
+  { 0x200B, 0x200F}, { 0x202A, 0x202E}, { 0x2060, 0x2064}, { 0x20D0, 0x20FF}, { 0x302A, 0x302D},
+  { 0x3099, 0x309A}, { 0xFE00, 0xFE0F}, { 0xFE20, 0xFE2F}, { 0xFEFF, 0xFEFF}, { 0xE0100, 0xE01EF}
+};
+
+//在排好序的范围表中二分查找cp
+int utf8_in_table( unsigned cp, const unsigned ( *table)[2], int n){
+  int lo = 0, hi = n - 1;
+  if( cp < table[0][0] || cp > table[n - 1][1])
+    return 0;
+  while( lo <= hi){
+    int mid = ( lo + hi) / 2;
+    if( cp > table[mid][1])
+      lo = mid + 1;
+    else if( cp < table[mid][0])
+      hi = mid - 1;
+    else
+      return 1;
+  }
+  return 0;
+}
+
+//基本多文种平面中各码位的显示宽度，每个码位2位，启动时由上面的范围表生成，查宽度时不必二分
+static unsigned char utf8_bmp_width[0x10000 / 4];
+
+//码位的显示宽度：组合字符为0，东亚宽字符为2，其他为1
+int utf8_cp_width( unsigned cp){
+  if( cp < 0x0300)  //拉丁字母等最常见的情况不查表
+    return 1;
+  if( cp < 0x10000)
+    return ( utf8_bmp_width[cp >> 2] >> ( ( cp & 3) * 2)) & 3;
+  if( utf8_in_table( cp, utf8_zero, sizeof( utf8_zero) / sizeof( utf8_zero[0])))
+    return 0;
+  if( cp >= 0x1100 && utf8_in_table( cp, utf8_wide, sizeof( utf8_wide) / sizeof( utf8_wide[0])))
+    return 2;
+  return 1;
+}
+
+//生成基本多文种平面的宽度表
+void utf8_init(){
+  unsigned cp = 0;
+  memset( utf8_bmp_width, 0, sizeof( utf8_bmp_width));
+  for( cp = 0; cp < 0x10000; ++cp){
+    unsigned w = 1;
+    if( cp >= 0x0300 && utf8_in_table( cp, utf8_zero, sizeof( utf8_zero) / sizeof( utf8_zero[0])))
+      w = 0;
+    else if( cp >= 0x1100 && utf8_in_table( cp, utf8_wide, sizeof( utf8_wide) / sizeof( utf8_wide[0])))
+      w = 2;
+    utf8_bmp_width[cp >> 2] |= w << ( ( cp & 3) * 2);
+  }
+}
+
+//解码s[0, n)开头的一个UTF-8字符，返回它的字节数；不是合法的UTF-8(截断、过长编码、代理区)时返回0
+int utf8_decode( const char* s, int n, unsigned* cp){
+  const unsigned char* u = ( const unsigned char*)s;
+  int len = 0;
+  unsigned c = u[0], min = 0;
+  if( c < 0x80){
+    *cp = c;
+    return 1;
+  } else if( c >= 0xC2 && c <= 0xDF){
+    len = 2;
+    c &= 0x1F;
+    min = 0x80;
+  } else if( c >= 0xE0 && c <= 0xEF){
+    len = 3;
+    c &= 0x0F;
+    min = 0x800;
+  } else if( c >= 0xF0 && c <= 0xF4){
+    len = 4;
+    c &= 0x07;
+    min = 0x10000;
+  } else {
+    return 0;
+  }
+  if( n < len)
+    return 0;
+  int i = -1;
+  for( i = 1; i < len; ++i){
+    if( ( u[i] & 0xC0) != 0x80)
+      return 0;
+    c = ( c << 6) | ( u[i] & 0x3F);
+  }
+  if( c < min || c > 0x10FFFF || ( c >= 0xD800 && c <= 0xDFFF))
+    return 0;
+  *cp = c;
+  return len;
+}
+
+//s[i]是不是它前面某个合法字符的后续字节
+int utf8_is_inside( const char* s, int len, int i){
+  int j = -1;
+  for( j = i - 1; j >= 0 && j >= i - 3; --j){
+    if( ( s[j] & 0xC0) != 0x80){
+      unsigned cp = 0;
+      return utf8_decode( s + j, len - j, &cp) > i - j;
+    }
+  }
+  return 0;
+}
+
+//显示列rx处s[i]开始的字符的显示宽度，*n为它的字节数；非法的字节单独算一个字符，宽度为1(显示为?)
+int text_char_width( const char* s, int len, int i, int rx, int* n){
+  unsigned char c = s[i];
+  *n = 1;
+  if( c == '\t')
+    return TAB_STOP - rx % TAB_STOP;
+  if( c < 0x80)
+    return 1;
+  unsigned cp = 0;
+  int k = utf8_decode( s + i, len - i, &cp);
+  if( k == 0)
+    return 1;
+  *n = k;
+  return utf8_cp_width( cp);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*** row operations ***/
+
+//行内容改变后调用，作废本行的列检查点和行标志，下次绘制时再计算
+void text_update_row( String_row* row) {
+  arena_free( &text.buf->grow, row->col_marks, row->col_mark_cap * sizeof( int));
+  row->col_marks = NULL;
+  row->col_mark_count = 0;
+  row->col_mark_cap = 0;
+  row->flags = ROW_FLAGS_UNKNOWN;
+  row->hl_state = HL_UNKNOWN;
+}
+
+//行的[at, at + len)处插入了s后调用：at之前的列检查点仍然有效，只丢掉后面的；已知的行标志并上新字节的标志
+//删除时len为0，行标志可能多报tab或控制字符，只会走慢一点的路径，不影响显示
+//这样在很长的行中连续输入时不必每个字符重新扫描整行
+void text_row_changed( String_row* row, int at, const char* s, int len){
+  row->hl_state = HL_UNKNOWN;
+  int keep = ( at > 3 ? at - 3 : 0) / COL_MARK_STEP + 1; //跨段的多字节字符可能在at之前最多3个字节处开始
+  if( row->col_mark_count > keep)
+    row->col_mark_count = keep;
+  if( !( row->flags & ROW_FLAGS_UNKNOWN) && len > 0){
+    unsigned flags = 0;
+    scan_line_end( s, s + len, &flags);
+    row->flags |= flags;
+  }
+}
+
+//需要时扫描编辑过的行的行标志，原始行在建立索引时已经得到
+String_row* text_row_scan( String_row* row) {
+  if( row->flags & ROW_FLAGS_UNKNOWN)
+    scan_line_end( row->one_row_string, row->one_row_string + row->size, &row->flags);
+  return row;
+}
+
+//从显示列rx开始经过s[from, to)后的显示列，没有非ASCII字节的行用memchr跳过tab之间的普通字符
+//有非ASCII字节时逐个字符解码：跨过to的字符整个算在这一段，段开头属于前一个字符的后续字节不算宽度
+int text_rx_advance( const char* s, int len, unsigned flags, int from, int to, int rx){
+  if( flags & ROW_HAS_HIGH){
+    while( from > 0 && from < to && ( s[from] & 0xC0) == 0x80 && utf8_is_inside( s, len, from))
+      ++from;
+    while( from < to){
+      unsigned char c = s[from];
+      if( c >= 32 && c < 0x80){ //ASCII字符不解码，8个字节都是可显示的ASCII字符时一次跨过
+        uint64_t w = 0;
+        while( from + 8 <= to && ( memcpy( &w, s + from, 8), ( ( w | ( w - 0x2020202020202020ull)) & 0x8080808080808080ull) == 0)){
+          rx += 8;
+          from += 8;
+        }
+        if( from < to && ( unsigned char)s[from] >= 32 && ( unsigned char)s[from] < 0x80){
+          ++rx;
+          ++from;
+        }
+      } else if( ( c & 0xE0) == 0xC0 && c >= 0xC2 && from + 1 < len && ( s[from + 1] & 0xC0) == 0x80){
+        unsigned cp = ( ( c & 0x1F) << 6) | ( s[from + 1] & 0x3F);  //2字节字符
+        rx += ( utf8_bmp_width[cp >> 2] >> ( ( cp & 3) * 2)) & 3;
+        from += 2;
+      } else if( ( c & 0xF0) == 0xE0 && from + 2 < len && ( s[from + 1] & 0xC0) == 0x80 && ( s[from + 2] & 0xC0) == 0x80
+        && ( c != 0xE0 || ( unsigned char)s[from + 1] >= 0xA0) && ( c != 0xED || ( unsigned char)s[from + 1] < 0xA0)){
+        unsigned cp = ( ( c & 0x0F) << 12) | ( ( s[from + 1] & 0x3F) << 6) | ( s[from + 2] & 0x3F); //汉字等3字节字符直接查表
+        rx += ( utf8_bmp_width[cp >> 2] >> ( ( cp & 3) * 2)) & 3;
+        from += 3;
+      } else {
+        int n = 1;
+        rx += text_char_width( s, len, from, rx, &n);
+        from += n;
+      }
+    }
+    return rx;
+  }
+  while( from < to){
+    const char* t = memchr( s + from, '\t', to - from);
+    int next = t ? t - s : to;
+    rx += next - from;
+    from = next;
+    if( from < to){
+      rx += TAB_STOP - rx % TAB_STOP;
+      ++from;
+    }
+  }
+  return rx;
+}
+
+//把含tab或非ASCII字节的行的列检查点向后算到第cx个字节所在的段，返回这一段的检查点下标
+//检查点每COL_MARK_STEP个字节一个，只算到用到的位置，不展开整行
+int text_row_mark( String_row* row, int cx){
+  if( cx > row->size)
+    cx = row->size;
+  int want = cx / COL_MARK_STEP;
+  if( row->col_mark_count == 0){
+    row->col_mark_count = 1;
+    if( row->col_mark_cap == 0){
+      row->col_mark_cap = 4;
+      row->col_marks = arena_alloc( &text.buf->grow, row->col_mark_cap * sizeof( int));
+    }
+    row->col_marks[0] = 0;
+  }
+  while( row->col_mark_count <= want){
+    if( row->col_mark_count == row->col_mark_cap){
+      int cap = row->col_mark_cap * 2;
+      row->col_marks = arena_realloc( &text.buf->grow, row->col_marks, row->col_mark_cap * sizeof( int), cap * sizeof( int));
+      row->col_mark_cap = cap;
+    }
+    int k = row->col_mark_count - 1;
+    row->col_marks[k + 1] = text_rx_advance( row->one_row_string, row->size, row->flags, k * COL_MARK_STEP, ( k + 1) * COL_MARK_STEP, row->col_marks[k]);
+    row->col_mark_count++;
+  }
+  return want;
+}
+
+//把行中的字符位置cx转换为tab展开、宽字符占两列后的显示位置，从最近的检查点开始算，最多扫描COL_MARK_STEP个字节
+int text_row_cx_to_rx( String_row* row, int cx){
+  text_row_scan( row);
+  if( cx > row->size)
+    cx = row->size;
+  if( !( row->flags & ( ROW_HAS_TAB | ROW_HAS_HIGH)))
+    return cx;
+  int k = text_row_mark( row, cx);
+  return text_rx_advance( row->one_row_string, row->size, row->flags, k * COL_MARK_STEP, cx, row->col_marks[k]);
+}
+
+//找到显示列rx所在的字符，返回它的位置，*start_rx为这个字符开始的显示列(tab或宽字符跨过rx时小于rx)
+//rx超过行尾时返回row->size
+int text_row_rx_to_cx( String_row* row, int rx, int* start_rx){
+  text_row_scan( row);
+  if( !( row->flags & ( ROW_HAS_TAB | ROW_HAS_HIGH))){
+    int cx = rx < row->size ? rx : row->size;
+    *start_rx = cx;
+    return cx;
+  }
+  //检查点向后扩展到越过rx，再二分找到rx所在的段
+  int last = ( row->size - 1) / COL_MARK_STEP;
+  text_row_mark( row, 0);
+  int k = row->col_mark_count - 1;  //已经算出的检查点不再逐个访问
+  while( k < last && row->col_marks[k] <= rx)
+    k = text_row_mark( row, ( k + 1) * COL_MARK_STEP);
+  int lo = 0, hi = k;
+  while( lo < hi){
+    int mid = ( lo + hi + 1) / 2;
+    if( row->col_marks[mid] <= rx)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  int cx = lo * COL_MARK_STEP;
+  int cur = row->col_marks[lo];
+  const char* s = row->one_row_string;
+  while( cx > 0 && cx < row->size && ( s[cx] & 0xC0) == 0x80 && utf8_is_inside( s, row->size, cx))
+    ++cx; //段开头是前一段最后一个字符的后续字节
+  while( cx < row->size){
+    int n = 1;
+    int next = cur + text_char_width( s, row->size, cx, cur, &n);
+    if( next > rx)
+      break;
+    cur = next;
+    cx += n;
+  }
+  *start_rx = cur;
+  return cx;
+}
+
+//s[i]开始的字符是组合字符等零宽字符时返回它的字节数，否则返回0
+int utf8_zero_width_at( const char* s, int len, int i){
+  unsigned cp = 0;
+  int n = ( unsigned char)s[i] >= 0xC0 ? utf8_decode( s + i, len - i, &cp) : 0;
+  return n > 0 && utf8_cp_width( cp) == 0 ? n : 0;
+}
+
+//s中i之前一个字符的开始位置，非法的字节单独算一个字符
+int utf8_prev( const char* s, int len, int i){
+  --i;
+  while( i > 0 && ( s[i] & 0xC0) == 0x80 && utf8_is_inside( s, len, i))
+    --i;
+  return i;
+}
+
+//第at行中cx之后一个字符的位置，后面跟着的组合字符一起跨过
+int text_row_next_char( int at, int cx){
+  String_row* row = text_row_scan( text_row_at( at));
+  if( cx >= row->size || !( row->flags & ROW_HAS_HIGH))
+    return cx + 1;
+  const char* s = row->one_row_string;
+  int n = 1, k = 0;
+  text_char_width( s, row->size, cx, 0, &n);
+  cx += n;
+  while( cx < row->size && ( k = utf8_zero_width_at( s, row->size, cx)) > 0)
+    cx += k;
+  return cx;
+}
+
+//第at行中cx之前一个字符的位置，组合字符和它前面的字符一起跨过
+int text_row_prev_char( int at, int cx){
+  String_row* row = text_row_scan( text_row_at( at));
+  if( cx <= 0)
+    return 0;
+  if( cx > row->size || !( row->flags & ROW_HAS_HIGH))
+    return cx - 1;
+  const char* s = row->one_row_string;
+  cx = utf8_prev( s, row->size, cx);
+  while( cx > 0 && utf8_zero_width_at( s, row->size, cx))
+    cx = utf8_prev( s, row->size, cx);
+  return cx;
+}
+
+//cx落在第at行一个多字节字符中间或组合字符上时(上下移动后)退到这个字符的开头
+int text_row_snap_char( int at, int cx){
+  if( !( text_row_flags( at) & ( ROW_HAS_HIGH | ROW_FLAGS_UNKNOWN)))
+    return cx;
+  String_row* row = text_row_scan( text_row_at( at));
+  const char* s = row->one_row_string;
+  if( cx <= 0 || cx >= row->size || !( row->flags & ROW_HAS_HIGH))
+    return cx;
+  if( ( s[cx] & 0xC0) == 0x80 && utf8_is_inside( s, row->size, cx))
+    cx = utf8_prev( s, row->size, cx);
+  while( cx > 0 && utf8_zero_width_at( s, row->size, cx))
+    cx = utf8_prev( s, row->size, cx);
+  return cx;
+}
+
+//颜色改变时才输出SGR，*cur为当前的颜色
+void text_set_color( struct String_buff* strb, int* cur, int color){
+  if( color == *cur)
+    return;
+  string_buff_appendf( strb, "\x1b[%dm", color);
+  *cur = color;
+}
+
+//生成行在显示列[col_off, col_off + cols)中的内容，只展开窗口内的字符，代价与行长和列位置无关
+//hl不为NULL时是各字节的颜色，同色的字符整段输出；没有颜色、tab、控制字符和非ASCII字节的行直接从行内容中截取
+void text_row_draw( struct String_buff* strb, String_row* row, int col_off, int cols, const unsigned char* hl){
+  text_row_scan( row);
+  if( hl == NULL && !( row->flags & ( ROW_HAS_TAB | ROW_HAS_CTRL | ROW_HAS_HIGH))){
+    int len = row->size - col_off;
+    if( len > cols)
+      len = cols;
+    if( len > 0)
+      string_buff_append( strb, &row->one_row_string[col_off], len);
+    return;
+  }
+
+  int rx = 0;
+  int end = col_off + cols;
+  int j = text_row_rx_to_cx( row, col_off, &rx);
+  int color = 39;
+  const char* s = row->one_row_string;
+  while( j < row->size && rx < end){
+    unsigned char c = s[j];
+    if( hl && c != '\t')  //tab显示为空格，不必改颜色
+      text_set_color( strb, &color, text_syntax_to_color( hl[j]));
+    if( c == '\t'){
+      int next = rx + TAB_STOP - rx % TAB_STOP;
+      if( next > end)
+        next = end;
+      string_buff_append_repeat( strb, ' ', next - ( rx < col_off ? col_off : rx));
+      rx = next;
+      ++j;
+    } else if( c < 32 || c == 127){ //其他控制字符显示为?，占一列
+      string_buff_append( strb, "?", 1);
+      ++rx;
+      ++j;
+    } else if( c >= 0x80){  //多字节字符
+      int n = 1;
+      int w = text_char_width( s, row->size, j, rx, &n);
+      if( n == 1) //不是合法的UTF-8，显示为?
+        string_buff_append( strb, "?", 1);
+      else if( rx < col_off || rx + w > end)  //宽字符跨过窗口左右边缘，只显示窗口内的空格
+        string_buff_append_repeat( strb, ' ', ( rx + w > end ? end : rx + w) - ( rx < col_off ? col_off : rx));
+      else
+        string_buff_append( strb, &s[j], n);
+      rx += w;
+      j += n;
+    } else {  //连续的ASCII字符整段追加
+      int k = j;
+      while( k < row->size && k - j < end - rx && ( unsigned char)s[k] >= 32 && ( unsigned char)s[k] < 127 && ( !hl || hl[k] == hl[j]))
+        ++k;
+      string_buff_append( strb, &s[j], k - j);
+      rx += k - j;
+      j = k;
+    }
+  }
+  text_set_color( strb, &color, 39); //每个屏幕行单独比较和输出，行尾恢复默认颜色
+}
+
+//在行的at处插入字符c
+void text_row_insert_char( String_row* row, int at, int c){
+  if( at < 0 || at > row->size)
+    at = row->size;
+  text_row_reserve( row, row->size + 2);
+  memmove( &row->one_row_string[at + 1], &row->one_row_string[at], row->size - at + 1);
+  row->size++;
+  row->one_row_string[at] = c;
+  text_row_changed( row, at, &row->one_row_string[at], 1);
+}
+
+//在行的at处插入字符串
+void text_row_insert_string( String_row* row, int at, const char* s, size_t len){
+  if( at < 0 || at > row->size)
+    at = row->size;
+  text_row_reserve( row, row->size + len + 1);
+  memmove( &row->one_row_string[at + len], &row->one_row_string[at], row->size - at + 1);
+  memcpy( &row->one_row_string[at], s, len);
+  row->size += len;
+  text_row_changed( row, at, s, len);
+}
+
+//在行末尾追加字符串
+void text_row_append_string( String_row* row, const char* s, size_t len){
+  text_row_reserve( row, row->size + len + 1);
+  memcpy( &row->one_row_string[row->size], s, len);
+  text_row_changed( row, row->size, s, len);
+  row->size += len;
+  row->one_row_string[row->size] = '\0';
+}
+
+//删除行中从at开始的len个字符
+void text_row_delete_range( String_row* row, int at, int len){
+  if( at < 0 || at >= row->size)
+    return;
+  if( len > row->size - at)
+    len = row->size - at;
+  memmove( &row->one_row_string[at], &row->one_row_string[at + len], row->size - at - len + 1);
+  row->size -= len;
+  text_row_changed( row, at, NULL, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*** syntax highlighting ***/
+//每行结束时的状态(是否在多行注释中)：原始行记在行索引的标志里，编辑过的行记在String_row中
+//绘制前只为可见的行计算状态，编辑后从改动的行向后重新计算，直到某一行的状态和原来相同为止
+//行的颜色在绘制时按需生成，只生成到显示窗口的右边
+
+int is_separator( int c){
+  return isspace( c) || c == '\0' || strchr( ",.()+-/*=~%<>[];", c) != NULL;
+}
+
+//s[i, i + n)着色为color，hl为NULL或超过limit的部分不写
+void hl_fill( unsigned char* hl, int i, int n, int color, int limit){
+  if( hl == NULL)
+    return;
+  if( i + n > limit)
+    n = limit - i;
+  if( n > 0)
+    memset( &hl[i], color, n);
+}
+
+//按text.syntax给一行着色，state为行首的状态，返回行尾的状态
+//hl为NULL时只计算行尾的状态，跳过数字和关键字；否则写入前limit个字节的颜色，写满后停止
+int hl_scan( const char* s, int len, int state, unsigned char* hl, int limit){
+  struct Text_syntax* syn = text.buf->syntax;
+  const char* scs = syn->singleline_comment_start;
+  const char* mcs = syn->multiline_comment_start;
+  const char* mce = syn->multiline_comment_end;
+  int scs_len = scs ? strlen( scs) : 0;
+  int mcs_len = mcs ? strlen( mcs) : 0;
+  int mce_len = mce ? strlen( mce) : 0;
+  int end = hl ? limit : len;
+  int prev_sep = 1;
+  int prev = HL_NORMAL; //前一个字节的颜色
+  int in_string = 0;
+  int in_comment = state;
+  int i = 0;
+
+  while( i < end){
+    unsigned char c = s[i];
+    if( scs_len && !in_string && !in_comment && i + scs_len <= len && !strncmp( &s[i], scs, scs_len)){
+      hl_fill( hl, i, len - i, HL_COMMENT, limit);
+      break;
+    }
+    if( mcs_len && mce_len && !in_string){
+      if( in_comment){
+        if( i + mce_len <= len && !strncmp( &s[i], mce, mce_len)){
+          hl_fill( hl, i, mce_len, HL_MLCOMMENT, limit);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+          prev = HL_MLCOMMENT;
+          continue;
+        }
+        const char* e = memchr( &s[i + 1], mce[0], len - i - 1);  //注释中直接跳到下一个可能的结尾
+        int n = e ? e - &s[i] : len - i;
+        hl_fill( hl, i, n, HL_MLCOMMENT, limit);
+        i += n;
+        continue;
+      } else if( i + mcs_len <= len && !strncmp( &s[i], mcs, mcs_len)){
+        hl_fill( hl, i, mcs_len, HL_MLCOMMENT, limit);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+    if( syn->flags & HL_HIGHLIGHT_STRINGS){
+      if( in_string){
+        hl_fill( hl, i, 1, HL_STRING, limit);
+        if( c == '\\' && i + 1 < len){
+          hl_fill( hl, i + 1, 1, HL_STRING, limit);
+          i += 2;
+          continue;
+        }
+        if( c == in_string)
+          in_string = 0;
+        ++i;
+        prev_sep = 1;
+        prev = HL_STRING;
+        continue;
+      } else if( c == '"' || c == '\''){
+        in_string = c;
+        hl_fill( hl, i, 1, HL_STRING, limit);
+        ++i;
+        continue;
+      }
+    }
+    if( hl && ( syn->flags & HL_HIGHLIGHT_NUMBERS)){
+      if( ( isdigit( c) && ( prev_sep || prev == HL_NUMBER)) || ( c == '.' && prev == HL_NUMBER)){
+        hl_fill( hl, i, 1, HL_NUMBER, limit);
+        ++i;
+        prev_sep = 0;
+        prev = HL_NUMBER;
+        continue;
+      }
+    }
+    if( hl && prev_sep){
+      //关键字以'|'结尾的是第二类关键字，以'!'结尾的是需要醒目显示的关键字
+      int j = -1;
+      int color = HL_NORMAL;
+      int klen = 0;
+      for( j = 0; syn->keywords[j]; ++j){
+        if( syn->keywords[j][0] != c) //先比较第一个字节，多数位置不必逐个比较关键字
+          continue;
+        klen = strlen( syn->keywords[j]);
+        char mark = syn->keywords[j][klen - 1];
+        color = mark == '|' ? HL_KEYWORD2 : mark == '!' ? HL_ALERT : HL_KEYWORD1;
+        if( color != HL_KEYWORD1)
+          --klen;
+        if( i + klen <= len && !strncmp( &s[i], syn->keywords[j], klen) && ( i + klen == len || is_separator( s[i + klen])))
+          break;
+      }
+      if( syn->keywords[j]){
+        hl_fill( hl, i, klen, color, limit);
+        i += klen;
+        prev_sep = 0;
+        prev = color;
+        continue;
+      }
+    }
+    hl_fill( hl, i, 1, HL_NORMAL, limit);
+    prev_sep = is_separator( c);
+    prev = HL_NORMAL;
+    ++i;
+  }
+  return in_comment;
+}
+
+//颜色对应的SGR前景色
+int text_syntax_to_color( int hl){
+  switch( hl){
+    case HL_COMMENT:
+    case HL_MLCOMMENT: return 36;
+    case HL_KEYWORD1: return 33;
+    case HL_KEYWORD2: return 32;
+    case HL_ALERT: return 91;
+    case HL_STRING: return 35;
+    case HL_NUMBER: return 31;
+    default: return 39;
+  }
+}
+
+//第at行行尾的状态，HL_UNKNOWN表示还没有算过
+int hl_state_at( int at){
+  int off = 0;
+  Row_piece* p = piece_find( at, &off);
+  if( p->row)
+    return p->row->hl_state;
+  int line = p->first + off;
+  unsigned f = 0;
+  unsigned char** hl = text.buf->hl_lines;
+  if( hl && hl[line >> LINE_CHUNK_SHIFT]) //缓冲区自己记录的状态优先
+    f = hl[line >> LINE_CHUNK_SHIFT][line & ( LINE_CHUNK - 1)];
+  if( !( f & ROW_HL_KNOWN) && text.buf->syntax == text.buf->file->hl_syntax)
+    f = line_flags_at( line);  //没有记过的行和原文件相同
+  return f & ROW_HL_KNOWN ? ( f & ROW_HL_COMMENT ? 1 : 0) : HL_UNKNOWN;
+}
+
+//记下第at行行尾的状态
+void hl_state_set( int at, int state){
+  int off = 0;
+  Row_piece* p = piece_find( at, &off);
+  if( p->row){
+    p->row->hl_state = state;
+    return;
+  }
+  int line = p->first + off;
+  Text_file* file = text.buf->file;
+  unsigned char* f = NULL;
+  if( file->hl_syntax == NULL)
+    file->hl_syntax = text.buf->syntax;
+  if( !text.buf->hl_private && file->hl_syntax == text.buf->syntax){
+    f = &text.buf->line_chunks[line >> LINE_CHUNK_SHIFT]->flags[line & ( LINE_CHUNK - 1)];
+  } else {
+    if( text.buf->hl_lines == NULL){
+      text.buf->hl_lines = calloc( file->line_chunk_count, sizeof( unsigned char*));
+      if( text.buf->hl_lines == NULL)
+        error_information( "calloc");
+      text.buf->hl_line_count = file->line_chunk_count;
+    }
+    unsigned char** chunk = &text.buf->hl_lines[line >> LINE_CHUNK_SHIFT];
+    if( *chunk == NULL){
+      *chunk = calloc( LINE_CHUNK, 1);
+      if( *chunk == NULL)
+        error_information( "calloc");
+    }
+    f = &( *chunk)[line & ( LINE_CHUNK - 1)];
+  }
+  *f = ( *f & ~( ROW_HL_KNOWN | ROW_HL_COMMENT)) | ROW_HL_KNOWN | ( state ? ROW_HL_COMMENT : 0);
+}
+
+//释放当前缓冲区自己记录的原始行高亮状态
+void hl_lines_free(){
+  size_t i = 0;
+  for( i = 0; i < text.buf->hl_line_count; ++i)
+    free( text.buf->hl_lines[i]);
+  free( text.buf->hl_lines);
+  text.buf->hl_lines = NULL;
+  text.buf->hl_line_count = 0;
+}
+
+//第at行及以后各行的状态可能已经过时
+void hl_mark_dirty( int at){
+  text.buf->hl_private = 1; //编辑过的缓冲区的状态和原文件不同，不再写共享的行索引
+  if( at < text.buf->hl_dirty)
+    text.buf->hl_dirty = at;
+}
+
+//从行首状态state算出第at行行尾的状态，超长的行不着色，状态原样传下去
+int hl_row_state( int at, int state){
+  String_row* row = text_row_at( at);
+  if( row->size > HL_LINE_MAX)
+    return state;
+  return hl_scan( row->one_row_string, row->size, state, NULL, 0);
+}
+
+//绘制前调用：保证可见各行和它上一行的状态已知
+//编辑过的行在可见区域附近时从那里向后重新计算，某一行算出的状态和原来相同时后面的行都不必再算
+//跳到没有算过的地方时最多往上找HL_SYNC_LINES行已知的状态，找不到时假设从那里开始不在注释中
+void hl_update_viewport(){
+  if( text.buf->syntax == NULL || text.buf->row_off >= text.buf->number_rows)
+    return;
+  if( text.buf->syntax->multiline_comment_start == NULL || grep.active)
+    return; //没有多行注释时每行都从普通状态开始，不需要逐行计算(跟随日志时跳到末尾不必扫描前面的行)；grep视图中可见的行不连续，按不在注释中处理
+  int first = text.buf->row_off;
+  int last = text.buf->row_off + text.screen_rows - 1;
+  if( last >= text.buf->number_rows)
+    last = text.buf->number_rows - 1;
+  int propagate = text.buf->hl_dirty <= last && text.buf->hl_dirty >= first - HL_SYNC_LINES;
+  int start = propagate && text.buf->hl_dirty < first ? text.buf->hl_dirty : first;
+
+  int r = start - 1;
+  int state = 0;
+  for( ; r >= 0 && start - r <= HL_SYNC_LINES; --r){
+    int s = r < text.buf->hl_dirty ? hl_state_at( r) : HL_UNKNOWN; //改动之后的行不可信
+    if( s != HL_UNKNOWN){
+      state = s;
+      break;
+    }
+  }
+
+  int i = -1;
+  for( i = r + 1; i <= last; ++i){
+    int old = hl_state_at( i);
+    if( old != HL_UNKNOWN && i < text.buf->hl_dirty){
+      state = old;
+      continue;
+    }
+    int s = hl_row_state( i, state);
+    if( s != old)
+      hl_state_set( i, s);
+    state = s;
+    if( propagate && i > text.buf->hl_dirty && s == old){ //状态稳定了，后面的行和改动前一致
+      text.buf->hl_dirty = INT_MAX;
+      propagate = 0;
+    }
+  }
+  if( propagate)
+    text.buf->hl_dirty = last + 1;
+}
+
+//生成第at行显示窗口中各字节的颜色，返回text.hl_buf；没有语法规则或行太长时返回NULL
+unsigned char* hl_row_colors( int at, String_row* row, int col_off, int cols){
+  if( text.buf->syntax == NULL || row->size > HL_LINE_MAX)
+    return NULL;
+  int rx = 0;
+  int limit = text_row_rx_to_cx( row, col_off + cols, &rx) + 1;  //跨过窗口右边的tab也要有颜色
+  if( limit > row->size)
+    limit = row->size;
+  if( limit >= text.hl_cap){
+    text.hl_cap = limit * 2 + 1;
+    text.hl_buf = realloc( text.hl_buf, text.hl_cap);
+    if( text.hl_buf == NULL)
+      error_information( "realloc");
+  }
+  int state = at > 0 ? hl_state_at( at - 1) : 0;
+  hl_scan( row->one_row_string, row->size, state == HL_UNKNOWN ? 0 : state, text.hl_buf, limit);
+  return text.hl_buf;
+}
+
+//按文件名选择语法规则
+void text_select_syntax(){
+  hl_lines_free(); //按原来的语法规则算的状态
+  text.buf->syntax = NULL;
+  text.buf->hl_dirty = INT_MAX;
+  if( text.buf->filename == NULL)
+    return;
+  const char* ext = strrchr( text.buf->filename, '.');
+  unsigned j = 0;
+  for( j = 0; j < sizeof( HLDB) / sizeof( HLDB[0]); ++j){
+    int i = -1;
+    for( i = 0; HLDB[j].filematch[i]; ++i){
+      const char* m = HLDB[j].filematch[i];
+      if( ( m[0] == '.' && ext && !strcmp( ext, m)) || ( m[0] != '.' && strstr( text.buf->filename, m))){
+        text.buf->syntax = &HLDB[j];
+        return;
+      }
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*** editor operations ***/
+
+//在光标处插入字符，光标在文件末尾的空行时先新建一行
+void text_insert_char( int c){
+  if( text.buf->cursor_y == text.buf->number_rows){
+    text_row_insert( text.buf->number_rows, "", 0);
+    undo_record( UNDO_ROW_ADD, text.buf->cursor_y, 0, NULL, 0);
+  }
+  String_row* row = text_row_edit( text.buf->cursor_y);
+  if( text.buf->cursor_x > row->size)
+    text.buf->cursor_x = row->size;
+  char ch = c;
+  text_row_insert_char( row, text.buf->cursor_x, c);
+  undo_record( UNDO_INSERT, text.buf->cursor_y, text.buf->cursor_x, &ch, 1);
+  text.buf->cursor_x++;
+}
+
+//在光标处插入一段不含换行的字符串，光标在文件末尾的空行时先新建一行
+void text_insert_string( const char* s, int len){
+  if( text.buf->cursor_y == text.buf->number_rows){
+    text_row_insert( text.buf->number_rows, "", 0);
+    undo_record( UNDO_ROW_ADD, text.buf->cursor_y, 0, NULL, 0);
+  }
+  String_row* row = text_row_edit( text.buf->cursor_y);
+  if( text.buf->cursor_x > row->size)
+    text.buf->cursor_x = row->size;
+  text_row_insert_string( row, text.buf->cursor_x, s, len);
+  undo_record( UNDO_INSERT, text.buf->cursor_y, text.buf->cursor_x, s, len);
+  text.buf->cursor_x += len;
+}
+
+//插入粘贴的文字：连续的可见字符整段插入，'\r'、'\n'、"\r\n"换行，其他控制字符忽略
+void text_paste( const char* s, int len){
+  int i = 0;
+  while( i < len){
+    int j = i;
+    while( j < len && ( s[j] == '\t' || !iscntrl( ( unsigned char)s[j])))
+      ++j;
+    if( j > i){
+      text_insert_string( &s[i], j - i);
+      text.paste_cr = 0;
+    }
+    if( j < len){
+      if( s[j] == '\r' || ( s[j] == '\n' && !text.paste_cr))
+        text_insert_newline();
+      text.paste_cr = ( s[j] == '\r');
+      ++j;
+    }
+    i = j;
+  }
+}
+
+//在第y行的x处拆成两行，x后的内容移到新的一行
+void text_split_row( int y, int x){
+  if( x == 0){
+    text_row_insert( y, "", 0);
+  } else {
+    String_row* row = text_row_edit( y);
+    text_row_insert( y + 1, &row->one_row_string[x], row->size - x);
+    row->size = x;
+    row->one_row_string[row->size] = '\0';
+    text_row_changed( row, row->size, NULL, 0);
+  }
+}
+
+//把第y + 1行接到第y行末尾
+void text_join_row( int y){
+  String_row* row = text_row_edit( y);
+  String_row* next = text_row_at( y + 1); //只读，不必复制出来
+  text_row_append_string( row, next->one_row_string, next->size);
+  text_row_delete( y + 1);
+}
+
+//在光标处换行，光标后的内容移到新的一行
+void text_insert_newline(){
+  if( text.buf->cursor_y == text.buf->number_rows){ //文件末尾的空行：只是加一行
+    text_row_insert( text.buf->number_rows, "", 0);
+    undo_record( UNDO_ROW_ADD, text.buf->cursor_y, 0, NULL, 0);
+  } else {
+    text_split_row( text.buf->cursor_y, text.buf->cursor_x);
+    undo_record( UNDO_SPLIT, text.buf->cursor_y, text.buf->cursor_x, NULL, 0);
+  }
+  text.buf->cursor_y++;
+  text.buf->cursor_x = 0;
+}
+
+//删除光标前的字符，在行首时把本行接到上一行末尾
+void text_delete_char(){
+  if( text.buf->cursor_y == text.buf->number_rows)
+    return;
+  if( text.buf->cursor_x == 0 && text.buf->cursor_y == 0)
+    return;
+
+  if( text.buf->cursor_x > 0){
+    int at = text_row_prev_char( text.buf->cursor_y, text.buf->cursor_x); //多字节字符整个删除
+    String_row* row = text_row_edit( text.buf->cursor_y);
+    undo_record( UNDO_DELETE, text.buf->cursor_y, at, &row->one_row_string[at], text.buf->cursor_x - at);
+    text_row_delete_range( row, at, text.buf->cursor_x - at);
+    text.buf->cursor_x = at;
+  } else {
+    text.buf->cursor_x = text_row_size( text.buf->cursor_y - 1);
+    text.buf->cursor_y--;
+    text_join_row( text.buf->cursor_y);
+    undo_record( UNDO_JOIN, text.buf->cursor_y, text.buf->cursor_x, NULL, 0);
+  }
+}
+
+
+/*** undo ***/
+//撤销日志：只追加插入、删除、拆行、合并行这几种操作和它们的位置，不保存行的快照
+//撤销和重做只重放一个操作，代价与改动的大小成正比，与文件大小无关
+//连续输入合并成一个操作；日志超过内存上限时从最旧的操作组开始丢弃
+
+//开始处理一个新的按键，之后记录的操作属于同一组，一起撤销
+void undo_begin(){
+  undo.group++;
+}
+
+//丢掉[from, count)的操作，释放它们的内容
+void undo_truncate( int from){
+  int i = -1;
+  for( i = from; i < undo.count; ++i){
+    arena_free( &undo.arena, undo.ops[i].bytes, undo.ops[i].cap);
+    undo.mem -= sizeof( Undo_op) + undo.ops[i].cap;
+  }
+  undo.count = from;
+  if( undo.cur > from)
+    undo.cur = from;
+}
+
+//超过内存上限时从最旧的一组开始丢弃，直到回到上限的3/4，最新的一组不丢；丢掉一半以上时把操作数组往前移
+void undo_trim(){
+  if( undo.mem <= undo.limit)
+    return;
+  long long newest = undo.ops[undo.count - 1].group;
+  while( undo.first < undo.cur && undo.mem > undo.limit / 4 * 3 && undo.ops[undo.first].group != newest){
+    long long g = undo.ops[undo.first].group;
+    while( undo.first < undo.cur && undo.ops[undo.first].group == g){
+      arena_free( &undo.arena, undo.ops[undo.first].bytes, undo.ops[undo.first].cap);
+      undo.mem -= sizeof( Undo_op) + undo.ops[undo.first].cap;
+      undo.first++;
+    }
+  }
+  if( undo.first > undo.count / 2){
+    memmove( undo.ops, &undo.ops[undo.first], sizeof( Undo_op) * ( undo.count - undo.first));
+    undo.count -= undo.first;
+    undo.cur -= undo.first;
+    undo.first = 0;
+  }
+}
+
+//记录一个已经执行的操作；新的操作使还没重做的操作作废
+//紧接着上一次输入(或退格)、时间间隔不超过UNDO_MERGE_MS的插入(删除)接到上一个操作上
+void undo_record( int type, int y, int x, const char* s, int len){
+  undo_truncate( undo.cur);
+  long long now = now_ns();
+  if( undo.count > undo.first){
+    Undo_op* last = &undo.ops[undo.count - 1];
+    int merge = last->type == type && last->y == y && now - last->ns <= UNDO_MERGE_MS * 1000000LL;
+    if( merge && type == UNDO_INSERT && last->x + last->len == x){
+      if( last->len + len > last->cap){
+        int cap = arena_round( ( last->len + len) * 2);
+        last->bytes = arena_realloc( &undo.arena, last->bytes, last->cap, cap);
+        undo.mem += cap - last->cap;
+        last->cap = cap;
+      }
+      memcpy( last->bytes + last->len, s, len);
+      last->len += len;
+      last->group = undo.group;
+      last->ns = now;
+      undo_trim();
+      return;
+    }
+    if( merge && type == UNDO_DELETE && x == last->x){ //Del：删掉的内容在后面
+      if( last->len + len > last->cap){
+        int cap = arena_round( ( last->len + len) * 2);
+        last->bytes = arena_realloc( &undo.arena, last->bytes, last->cap, cap);
+        undo.mem += cap - last->cap;
+        last->cap = cap;
+      }
+      memcpy( last->bytes + last->len, s, len);
+      last->len += len;
+      last->group = undo.group;
+      last->ns = now;
+      undo_trim();
+      return;
+    }
+    if( merge && type == UNDO_DELETE && x + len == last->x){ //退格：删掉的内容在前面
+      if( last->len + len > last->cap){
+        int cap = arena_round( ( last->len + len) * 2);
+        last->bytes = arena_realloc( &undo.arena, last->bytes, last->cap, cap);
+        undo.mem += cap - last->cap;
+        last->cap = cap;
+      }
+      memmove( last->bytes + len, last->bytes, last->len);
+      memcpy( last->bytes, s, len);
+      last->len += len;
+      last->x = x;
+      last->group = undo.group;
+      last->ns = now;
+      undo_trim();
+      return;
+    }
+  }
+
+  if( undo.count == undo.cap){
+    undo.cap = undo.cap ? undo.cap * 2 : 256;
+    undo.ops = realloc( undo.ops, sizeof( Undo_op) * undo.cap);
+    if( undo.ops == NULL)
+      error_information( "realloc");
+  }
+  Undo_op* op = &undo.ops[undo.count++];
+  op->type = type;
+  op->y = y;
+  op->x = x;
+  op->len = len;
+  op->cap = len ? arena_round( len) : 0;
+  op->bytes = len ? arena_alloc( &undo.arena, op->cap) : NULL;
+  if( len)
+    memcpy( op->bytes, s, len);
+  op->group = undo.group;
+  op->ns = now;
+  undo.cur = undo.count;
+  undo.mem += sizeof( Undo_op) + op->cap;
+  undo_trim();
+}
+
+//执行一个操作(reverse为1时执行它的逆操作)，光标放到改动处
+void undo_apply( Undo_op* op, int reverse){
+  int type = op->type;
+  if( reverse)  //插入和删除、拆行和合并行、加行和删行互为逆操作
+    type ^= 1;
+  text.buf->cursor_y = op->y;
+  text.buf->cursor_x = op->x;
+  if( type == UNDO_INSERT){
+    text_row_insert_string( text_row_edit( op->y), op->x, op->bytes, op->len);
+    text.buf->cursor_x += op->len;
+  } else if( type == UNDO_DELETE){
+    text_row_delete_range( text_row_edit( op->y), op->x, op->len);
+  } else if( type == UNDO_SPLIT){
+    text_split_row( op->y, op->x);
+    text.buf->cursor_y++;
+    text.buf->cursor_x = 0;
+  } else if( type == UNDO_JOIN){
+    text_join_row( op->y);
+  } else if( type == UNDO_ROW_ADD){
+    text_row_insert( op->y, "", 0);
+  } else {
+    text_row_delete( op->y);
+  }
+}
+
+//Ctrl-Z：撤销最近的一组操作
+void text_undo(){
+  if( undo.cur == undo.first){
+    snprintf( text.message, sizeof( text.message), "Nothing to undo");
+    return;
+  }
+  long long g = undo.ops[undo.cur - 1].group;
+  while( undo.cur > undo.first && undo.ops[undo.cur - 1].group == g)
+    undo_apply( &undo.ops[--undo.cur], 1);
+}
+
+//Ctrl-Y：重做最近撤销的一组操作
+void text_redo(){
+  if( undo.cur == undo.count){
+    snprintf( text.message, sizeof( text.message), "Nothing to redo");
+    return;
+  }
+  long long g = undo.ops[undo.cur].group;
+  while( undo.cur < undo.count && undo.ops[undo.cur].group == g)
+    undo_apply( &undo.ops[undo.cur++], 0);
+}
+
+//清空撤销日志，关闭文件时调用
+void undo_reset(){
+  arena_release( &undo.arena);
+  undo.first = undo.count = undo.cur = 0;
+  undo.mem = 0;
+}
+
+//内存上限可以用环境变量KILO_UNDO_MB设置
+void undo_init(){
+  memset( &undo, 0, sizeof( undo));
+  const char* mb = getenv( "KILO_UNDO_MB");
+  undo.limit = ( mb && atol( mb) > 0 ? ( size_t)atol( mb) : UNDO_MEM_MB) << 20;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*** search ***/
+//Ctrl-F增量搜索：片段树展开成ORIGINAL段(map中连续的字节)和ADDED段，再切成分片交给工作线程并行扫描
+//分片按从光标开始的顺序领取，第一个匹配所在的分片一扫完就能跳过去，其余分片在后台继续计数
+//搜索内容只是加长时，新的匹配只可能出现在上一次的匹配位置上，只需检查上一次记录的位置
+
+#if defined( __x86_64__) || defined( __i386__)
+
+//AVX2搜索内核：一次比较32个位置的首字节和尾字节，两者都相同的位置再用memcmp确认
+__attribute__(( target( "avx2")))
+const char* search_memmem_avx2( const char* h, size_t n, const char* q, size_t m){
+  if( m == 0)
+    return h;
+  if( n < m)
+    return NULL;
+  if( m == 1)
+    return memchr( h, q[0], n);
+  const __m256i first = _mm256_set1_epi8( q[0]);
+  const __m256i last = _mm256_set1_epi8( q[m - 1]);
+  size_t i = 0;
+  for( ; i + m - 1 + 32 <= n; i += 32){
+    __m256i bf = _mm256_loadu_si256( ( const __m256i*)( h + i));
+    __m256i bl = _mm256_loadu_si256( ( const __m256i*)( h + i + m - 1));
+    unsigned mask = _mm256_movemask_epi8( _mm256_and_si256( _mm256_cmpeq_epi8( bf, first), _mm256_cmpeq_epi8( bl, last)));
+    while( mask){
+      int bit = __builtin_ctz( mask);
+      if( memcmp( h + i + bit + 1, q + 1, m - 2) == 0)
+        return h + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return memmem( h + i, n - i, q, m); //最后不足一组的位置
+}
+
+#endif
+
+//glibc的memmem(Two-Way算法)，CPU不支持AVX2时使用
+const char* search_memmem_libc( const char* h, size_t n, const char* q, size_t m){
+  return memmem( h, n, q, m);
+}
+
+//选择工作线程数量，每个CPU一个
+void search_init(){
+  long n = sysconf( _SC_NPROCESSORS_ONLN);
+  if( n < 1)
+    n = 1;
+  if( n > SEARCH_MAX_THREADS)
+    n = SEARCH_MAX_THREADS;
+  search.thread_count = n;
+  search.segs = NULL;
+  search.seg_count = search.seg_cap = 0;
+  search.shards = NULL;
+  search.shard_count = search.shard_cap = 0;
+  search.running = 0;
+  search.cancel = 0;
+  search.qlen = 0;
+  search.query[0] = '\0';
+  search.cur_step = -1;
+}
+
+//按行号顺序把片段树展开到segs中，相邻的ADDED片段合成一段；搜索和grep共用
+void search_collect( Row_piece* t, int* row, Search_segment** segs, int* seg_count, int* seg_cap){
+  if( !t)
+    return;
+  search_collect( t->left, row, segs, seg_count, seg_cap);
+  Search_segment* last = *seg_count ? &( *segs)[*seg_count - 1] : NULL;
+  if( t->row && last && last->first == -1){
+    if( ( last->lines & ( last->lines - 1)) == 0){ //行数到2的幂时容量翻倍
+      last->rows = realloc( last->rows, sizeof( String_row*) * last->lines * 2);
+      if( last->rows == NULL)
+        error_information( "realloc");
+    }
+    last->rows[last->lines++] = t->row;
+  } else {
+    if( *seg_count == *seg_cap){
+      *seg_cap = *seg_cap ? *seg_cap * 2 : 64;
+      *segs = realloc( *segs, sizeof( Search_segment) * *seg_cap);
+      if( *segs == NULL)
+        error_information( "realloc");
+    }
+    Search_segment* sg = &( *segs)[( *seg_count)++];
+    sg->row = *row;
+    sg->first = t->row ? -1 : t->first;
+    sg->lines = t->lines;
+    sg->rows = NULL;
+    if( t->row){
+      sg->rows = malloc( sizeof( String_row*));
+      if( sg->rows == NULL)
+        error_information( "malloc");
+      sg->rows[0] = t->row;
+    }
+  }
+  *row += t->lines;
+  search_collect( t->right, row, segs, seg_count, seg_cap);
+}
+
+//增加一个分片
+void search_add_shard( int seg, long long from, long long to){
+  if( search.shard_count == search.shard_cap){
+    search.shard_cap = search.shard_cap ? search.shard_cap * 2 : 64;
+    search.shards = realloc( search.shards, sizeof( Search_shard) * search.shard_cap);
+    if( search.shards == NULL)
+      error_information( "realloc");
+  }
+  Search_shard* sh = &search.shards[search.shard_count++];
+  memset( sh, 0, sizeof( Search_shard));
+  sh->seg = seg;
+  sh->from = from;
+  sh->to = to;
+}
+
+//展开片段树并切分片：ORIGINAL段按字节数在行尾切开，匹配不会跨过分片边界；ADDED段按行数切
+void search_build(){
+  int row = 0;
+  int i = -1;
+  search_collect( text.buf->rows, &row, &search.segs, &search.seg_count, &search.seg_cap);
+  for( i = 0; i < search.seg_count; ++i){
+    Search_segment* sg = &search.segs[i];
+    if( sg->first == -1){
+      long long r = -1;
+      for( r = sg->row; r < sg->row + sg->lines; r += SEARCH_SHARD_ROWS)
+        search_add_shard( i, r, r + SEARCH_SHARD_ROWS < sg->row + sg->lines ? r + SEARCH_SHARD_ROWS : sg->row + sg->lines);
+      continue;
+    }
+    long long from = line_start_at( sg->first);
+    long long end = line_start_at( sg->first + sg->lines);
+    while( from < end){
+      long long to = from + SEARCH_SHARD_BYTES;
+      if( to >= end){
+        to = end;
+      } else {
+        const char* nl = memchr( text.buf->map + to, '\n', end - to);
+        to = nl ? nl - text.buf->map + 1 : end;
+      }
+      search_add_shard( i, from, to);
+      from = to;
+    }
+  }
+}
+
+//找到光标位置所在的分片和对应的键，第一个匹配从这里开始找
+void search_set_origin( int row, int col){
+  int i = -1;
+  search.origin_shard = 0;
+  search.origin_key = 0;
+  for( i = 0; i < search.shard_count; ++i){
+    Search_shard* sh = &search.shards[i];
+    Search_segment* sg = &search.segs[sh->seg];
+    if( row < sg->row || row >= sg->row + sg->lines)
+      continue;
+    long long key = -1;
+    if( sg->first == -1){
+      if( row >= sh->to)
+        continue;
+      key = ( long long)row << 32 | col;
+    } else {
+      key = line_start_at( sg->first + row - sg->row) + col;
+      if( key >= sh->to)
+        continue;
+    }
+    search.origin_shard = i;
+    search.origin_key = key;
+    return;
+  }
+}
+
+//记录分片中的一个匹配，返回0表示不需要继续扫描
+int search_shard_add( Search_shard* sh, long long key, long long* count, int count_all){
+  if( sh->hit_count < SEARCH_SHARD_HITS){
+    sh->hits[sh->hit_count++] = key;
+  } else {
+    sh->more = 1;
+    if( !count_all)
+      return 0;
+  }
+  ++*count;
+  if( ( *count & 1023) == 0 && __atomic_load_n( &search.cancel, __ATOMIC_RELAXED))
+    return 0;
+  return 1;
+}
+
+//扫描分片中键不小于from的匹配，记录前SEARCH_SHARD_HITS个；count_all时数完所有匹配，否则记录满就停下
+void search_shard_fill( Search_shard* sh, long long from, int count_all){
+  Search_segment* sg = &search.segs[sh->seg];
+  long long count = 0;
+  if( sh->hits == NULL){
+    sh->hits = malloc( sizeof( long long) * SEARCH_SHARD_HITS);
+    if( sh->hits == NULL)
+      error_information( "malloc");
+  }
+  sh->hit_count = 0;
+  sh->more = 0;
+  sh->window_from = from;
+
+  if( sg->first != -1){
+    const char* p = text.buf->map + ( from > sh->from ? from : sh->from);
+    const char* end = text.buf->map + sh->to;
+    const char* q;
+    while( ( q = search_memmem( p, end - p, search.query, search.qlen)) != NULL){
+      if( !search_shard_add( sh, q - text.buf->map, &count, count_all))
+        break;
+      p = q + 1;
+    }
+  } else {
+    long long r = sh->from;
+    int col = 0;
+    if( from > ( sh->from << 32)){
+      r = from >> 32;
+      col = from & 0xffffffff;
+    }
+    int stop = 0;
+    for( ; r < sh->to && !stop; ++r, col = 0){
+      String_row* row = sg->rows[r - sg->row];
+      const char* s = row->one_row_string;
+      const char* p = s + ( col < row->size ? col : row->size);
+      const char* q;
+      while( ( q = search_memmem( p, s + row->size - p, search.query, search.qlen)) != NULL){
+        if( !search_shard_add( sh, r << 32 | ( q - s), &count, count_all)){
+          stop = 1;
+          break;
+        }
+        p = q + 1;
+      }
+    }
+  }
+  if( count_all)
+    sh->count = count;
+}
+
+//只检查上一次记录的匹配位置，新内容是上一次的内容加长得到的
+void search_shard_filter( Search_shard* sh){
+  Search_segment* sg = &search.segs[sh->seg];
+  int i = -1;
+  int n = 0;
+  for( i = 0; i < sh->hit_count; ++i){
+    long long key = sh->hits[i];
+    const char* p;
+    long long room;
+    if( sg->first != -1){
+      p = text.buf->map + key;
+      room = sh->to - key;
+    } else {
+      String_row* row = sg->rows[( key >> 32) - sg->row];
+      int col = key & 0xffffffff;
+      p = row->one_row_string + col;
+      room = row->size - col;
+    }
+    if( room >= search.qlen && memcmp( p, search.query, search.qlen) == 0)
+      sh->hits[n++] = key;
+  }
+  sh->hit_count = n;
+  sh->count = n;
+}
+
+//搜索工作线程：按从光标开始的顺序领取分片，每扫完一个就发布并唤醒主循环
+void* search_worker( void* arg){
+  ( void)arg;
+  while( !__atomic_load_n( &search.cancel, __ATOMIC_RELAXED)){
+    int k = __atomic_fetch_add( &search.next_shard, 1, __ATOMIC_RELAXED);
+    if( k >= search.shard_count)
+      break;
+    Search_shard* sh = &search.shards[( search.origin_shard + k) % search.shard_count];
+    if( search.filter)
+      search_shard_filter( sh);
+    else
+      search_shard_fill( sh, 0, 1);
+    if( __atomic_load_n( &search.cancel, __ATOMIC_RELAXED))
+      break;  //扫描被打断，结果不完整，不发布
+    __atomic_store_n( &sh->done, 1, __ATOMIC_RELEASE);
+    event_wake();
+  }
+  return NULL;
+}
+
+//等待工作线程结束
+void search_wait(){
+  int i = -1;
+  for( i = 0; i < search.running; ++i)
+    pthread_join( search.threads[i], NULL);
+  search.running = 0;
+}
+
+//让工作线程尽快结束并等待它们
+void search_stop(){
+  __atomic_store_n( &search.cancel, 1, __ATOMIC_RELAXED);
+  search_wait();
+  search.cancel = 0;
+}
+
+//所有分片都扫描完且记录了全部匹配位置，可以用来过滤加长后的内容
+//查找下一个时从中间重新扫描过的分片(window_from不为0)只记录了后一部分，不算完整
+int search_cached(){
+  int i = -1;
+  for( i = 0; i < search.shard_count; ++i)
+    if( !__atomic_load_n( &search.shards[i].done, __ATOMIC_ACQUIRE) || search.shards[i].more
+      || search.shards[i].window_from != 0)
+      return 0;
+  return 1;
+}
+
+//搜索内容改变：停止上一次的扫描，重新把分片交给工作线程
+void search_update( const char* query){
+  int len = strlen( query);
+  if( len >= SEARCH_QUERY_MAX)
+    len = SEARCH_QUERY_MAX - 1;
+  search_stop();
+  search.filter = search.qlen > 0 && len >= search.qlen
+    && memcmp( query, search.query, search.qlen) == 0 && search_cached();
+  memcpy( search.query, query, len);
+  search.query[len] = '\0';
+  search.qlen = len;
+  search.cur_step = -1;
+
+  int i = -1;
+  for( i = 0; i < search.shard_count; ++i){
+    Search_shard* sh = &search.shards[i];
+    sh->done = 0;
+    if( !search.filter){
+      sh->hit_count = 0;
+      sh->more = 0;
+      sh->window_from = 0;
+      sh->count = 0;
+    }
+  }
+  if( len == 0 || search.shard_count == 0)
+    return;
+  search.next_shard = 0;
+  for( i = 0; i < search.thread_count; ++i){
+    if( pthread_create( &search.threads[i], NULL, search_worker, NULL) != 0)
+      error_information( "pthread_create");
+    search.running++;
+  }
+}
+
+//按从光标开始的顺序，第step个分片；第shard_count个又是开始的分片，只含光标之前的部分
+Search_shard* search_step_shard( int step){
+  return &search.shards[( search.origin_shard + step) % search.shard_count];
+}
+
+//分片中键大于after的第一个匹配，记录的位置不够时从after之后重新扫描这个分片
+int search_shard_next( Search_shard* sh, long long after, long long* key){
+  if( after + 1 >= sh->window_from){
+    int lo = 0, hi = sh->hit_count; //二分找第一个大于after的记录
+    while( lo < hi){
+      int mid = lo + ( hi - lo) / 2;
+      if( sh->hits[mid] > after)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    if( lo < sh->hit_count){
+      *key = sh->hits[lo];
+      return 1;
+    }
+    if( !sh->more)
+      return 0;
+  }
+  search_shard_fill( sh, after + 1, 0);
+  if( sh->hit_count == 0)
+    return 0;
+  *key = sh->hits[0];
+  return 1;
+}
+
+//分片中键在[lower, before)中的最后一个匹配
+int search_shard_prev( Search_shard* sh, long long lower, long long before, long long* key){
+  int found = 0;
+  long long k = lower - 1;
+  long long next = 0;
+  while( search_shard_next( sh, k, &next) && next < before){
+    *key = next;
+    found = 1;
+    k = next;
+  }
+  return found;
+}
+
+//从当前匹配向后找下一个匹配，还没有当前匹配时找光标之后的第一个
+//需要的分片还没扫描完时返回0，等工作线程发布后再试
+int search_next(){
+  int n = search.shard_count;
+  int step = search.cur_step;
+  long long after = search.cur_key;
+  int tries = -1;
+  if( n == 0 || search.qlen == 0)
+    return 0;
+  if( step == -1){
+    step = 0;
+    after = search.origin_key - 1;
+  }
+  for( tries = 0; tries <= n + 1; ++tries){
+    Search_shard* sh = search_step_shard( step);
+    if( !__atomic_load_n( &sh->done, __ATOMIC_ACQUIRE))
+      return 0;
+    long long key = 0;
+    if( search_shard_next( sh, after, &key) && !( step == n && key >= search.origin_key)){
+      search.cur_step = step;
+      search.cur_key = key;
+      return 1;
+    }
+    if( step == n){ //绕回开头
+      step = 0;
+      after = search.origin_key - 1;
+    } else {
+      ++step;
+      after = -1;
+    }
+  }
+  return 0;
+}
+
+//从当前匹配向前找上一个匹配
+int search_prev(){
+  int n = search.shard_count;
+  int step = search.cur_step;
+  long long before = search.cur_key;
+  int tries = -1;
+  if( step == -1)
+    return search_next();
+  for( tries = 0; tries <= n + 1; ++tries){
+    Search_shard* sh = search_step_shard( step);
+    if( !__atomic_load_n( &sh->done, __ATOMIC_ACQUIRE))
+      return 0;
+    long long key = 0;
+    if( search_shard_prev( sh, step == 0 ? search.origin_key : 0, before, &key)){
+      search.cur_step = step;
+      search.cur_key = key;
+      return 1;
+    }
+    if( step == 0){ //绕回末尾
+      step = n;
+      before = search.origin_key;
+    } else {
+      --step;
+      before = LLONG_MAX;
+    }
+  }
+  return 0;
+}
+
+//把匹配的键转换为行号和列
+void search_key_pos( Search_shard* sh, long long key, int* row, int* col){
+  Search_segment* sg = &search.segs[sh->seg];
+  if( sg->first == -1){
+    *row = key >> 32;
+    *col = key & 0xffffffff;
+    return;
+  }
+  int lo = sg->first, hi = sg->first + sg->lines - 1; //二分找最后一个起始位置不超过key的行
+  while( lo < hi){
+    int mid = lo + ( hi - lo + 1) / 2;
+    if( ( long long)line_start_at( mid) <= key)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  *row = sg->row + lo - sg->first;
+  *col = key - line_start_at( lo);
+}
+
+//光标移到当前匹配，匹配所在行滚动到屏幕顶端
+void search_show_current(){
+  search_key_pos( search_step_shard( search.cur_step), search.cur_key, &text.buf->cursor_y, &text.buf->cursor_x);
+  text.buf->row_off = text.buf->number_rows;
+}
+
+//更新提示框后面的匹配个数
+void search_update_info(){
+  long long total = 0;
+  int done = 0;
+  int i = -1;
+  for( i = 0; i < search.shard_count; ++i){
+    if( __atomic_load_n( &search.shards[i].done, __ATOMIC_ACQUIRE)){
+      total += search.shards[i].count;
+      ++done;
+    }
+  }
+  if( search.qlen == 0)
+    text.prompt_info[0] = '\0';
+  else if( done < search.shard_count)
+    snprintf( text.prompt_info, sizeof( text.prompt_info), "[%lld+ matches, %d%%]", total, done * 100 / search.shard_count);
+  else
+    snprintf( text.prompt_info, sizeof( text.prompt_info), "[%lld matches]", total);
+}
+
+//开始一次搜索：记下光标位置，展开片段树
+void search_begin(){
+  search.saved_cx = text.buf->cursor_x;
+  search.saved_cy = text.buf->cursor_y;
+  search.saved_row_off = text.buf->row_off;
+  search.saved_col_off = text.buf->col_off;
+  search.seg_count = 0;
+  search.shard_count = 0;
+  search_build();
+  search_set_origin( text.buf->cursor_y, text.buf->cursor_x);
+  search.qlen = 0;
+  search.query[0] = '\0';
+  search.cur_step = -1;
+  text.prompt_info[0] = '\0';
+}
+
+//结束搜索：停止工作线程，释放展开的段和分片
+void search_end(){
+  int i = -1;
+  search_stop();
+  for( i = 0; i < search.seg_count; ++i)
+    free( search.segs[i].rows);
+  for( i = 0; i < search.shard_count; ++i)
+    free( search.shards[i].hits);
+  free( search.segs);
+  free( search.shards);
+  search.segs = NULL;
+  search.shards = NULL;
+  search.seg_count = search.seg_cap = 0;
+  search.shard_count = search.shard_cap = 0;
+  search.qlen = 0;
+  search.query[0] = '\0';
+  text.prompt_info[0] = '\0';
+}
+
+//光标回到开始搜索时的位置
+void search_restore_cursor(){
+  text.buf->cursor_x = search.saved_cx;
+  text.buf->cursor_y = search.saved_cy;
+  text.buf->row_off = search.saved_row_off;
+  text.buf->col_off = search.saved_col_off;
+}
+
+//提示框的回调：内容改变时重新搜索，方向键在匹配之间移动，其他事件时取回后台的结果
+void search_callback( char* query, int key){
+  if( key == '\r' || key == '\x1b'){
+    if( key == '\x1b')
+      search_restore_cursor();
+    search_end();
+    return;
+  }
+  if( key == ARROW_DOWN || key == ARROW_RIGHT){
+    if( search_next())
+      search_show_current();
+  } else if( key == ARROW_UP || key == ARROW_LEFT){
+    if( search_prev())
+      search_show_current();
+  } else if( strncmp( query, search.query, SEARCH_QUERY_MAX - 1) != 0){
+    search_restore_cursor();
+    search_update( query);
+  }
+  if( search.cur_step == -1 && search_next())
+    search_show_current();
+  search_update_info();
+}
+
+//Ctrl-F：增量搜索，回车停在匹配处，ESC回到原来的位置
+void text_find(){
+  search_begin();
+  char* query = text_prompt( "Search: %s (ESC/Arrows/Enter)", search_callback);
+  free( query);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*** grep view ***/
+//Ctrl-G输入POSIX扩展正则表达式，只显示匹配的行；ORIGINAL段按字节数在行首切成分片，ADDED段按行数切，多个线程并行扫描
+//视图中只能移动光标，编辑等其他按键先离开视图(光标停在当前行)再照常处理；ESC或回车离开，扫描中Ctrl-G停止扫描
+
+//增加一个分片
+void grep_add_shard( int seg, int row, long long from, long long to){
+  if( grep.shard_count == grep.shard_cap){
+    grep.shard_cap = grep.shard_cap ? grep.shard_cap * 2 : 64;
+    grep.shards = realloc( grep.shards, sizeof( Grep_shard) * grep.shard_cap);
+    if( grep.shards == NULL)
+      error_information( "realloc");
+  }
+  Grep_shard* sh = &grep.shards[grep.shard_count++];
+  memset( sh, 0, sizeof( Grep_shard));
+  sh->seg = seg;
+  sh->row = row;
+  sh->from = from;
+  sh->to = to;
+}
+
+//展开片段树并切分片；ORIGINAL段用行索引二分找到约GREP_SHARD_BYTES字节处的行首，分片的起始行号不需要数换行
+void grep_build(){
+  int row = 0;
+  int i = -1;
+  search_collect( text.buf->rows, &row, &grep.segs, &grep.seg_count, &grep.seg_cap);
+  for( i = 0; i < grep.seg_count; ++i){
+    Search_segment* sg = &grep.segs[i];
+    int r = sg->row;
+    if( sg->first == -1){
+      for( ; r < sg->row + sg->lines; r += SEARCH_SHARD_ROWS)
+        grep_add_shard( i, r, r, r + SEARCH_SHARD_ROWS < sg->row + sg->lines ? r + SEARCH_SHARD_ROWS : sg->row + sg->lines);
+      continue;
+    }
+    int line = sg->first, last = sg->first + sg->lines;
+    long long from = line_start_at( line);
+    while( line < last){
+      int lo = line + 1, hi = last;  //找最后一个起始位置不超过from + GREP_SHARD_BYTES的行，至少一行
+      while( lo < hi){
+        int mid = lo + ( hi - lo + 1) / 2;
+        if( ( long long)line_start_at( mid) - from <= GREP_SHARD_BYTES)
+          lo = mid;
+        else
+          hi = mid - 1;
+      }
+      long long to = line_start_at( lo);
+      grep_add_shard( i, sg->row + line - sg->first, from, to);
+      line = lo;
+      from = to;
+    }
+  }
+}
+
+//记下分片中的一个匹配行
+void grep_shard_add( Grep_shard* sh, int row){
+  if( sh->count == sh->cap){
+    sh->cap = sh->cap ? sh->cap * 2 : 256;
+    sh->rows = realloc( sh->rows, sizeof( int) * sh->cap);
+    if( sh->rows == NULL)
+      error_information( "realloc");
+  }
+  sh->rows[sh->count++] = row;
+}
+
+//扫描一个分片：ORIGINAL分片整段交给regexec(REG_NEWLINE，匹配不跨行)，找到后数出所在的行，再从下一行开始
+//ADDED分片逐行匹配；每个匹配或每行之后检查是否被取消
+void grep_shard_scan( Grep_shard* sh, regex_t* re){
+  Search_segment* sg = &grep.segs[sh->seg];
+  regmatch_t m;
+  if( sg->first != -1){
+    const char* line = grep.map + sh->from;
+    const char* end = grep.map + sh->to;
+    int row = sh->row;
+    while( line < end && !__atomic_load_n( &grep.cancel, __ATOMIC_RELAXED)){
+      m.rm_so = line - grep.map;
+      m.rm_eo = sh->to;
+      if( regexec( re, grep.map, 1, &m, REG_STARTEND) != 0)
+        break;
+      const char* at = grep.map + m.rm_so;
+      const char* nl;
+      while( ( nl = memchr( line, '\n', at - line)) != NULL){
+        ++row;
+        line = nl + 1;
+      }
+      grep_shard_add( sh, row);
+      nl = memchr( at, '\n', end - at);
+      if( nl == NULL)
+        break;
+      ++row;
+      line = nl + 1;
+    }
+  } else {
+    long long r = -1;
+    for( r = sh->from; r < sh->to && !__atomic_load_n( &grep.cancel, __ATOMIC_RELAXED); ++r){
+      String_row* row = sg->rows[r - sg->row];
+      m.rm_so = 0;
+      m.rm_eo = row->size;
+      if( regexec( re, row->one_row_string, 1, &m, REG_STARTEND) == 0)
+        grep_shard_add( sh, r);
+    }
+  }
+}
+
+//grep工作线程：按顺序领取分片，扫完一个就发布并唤醒主循环
+void* grep_worker( void* arg){
+  regex_t* re = arg;
+  while( !__atomic_load_n( &grep.cancel, __ATOMIC_RELAXED)){
+    int k = __atomic_fetch_add( &grep.next_shard, 1, __ATOMIC_RELAXED);
+    if( k >= grep.shard_count)
+      break;
+    grep_shard_scan( &grep.shards[k], re);
+    if( __atomic_load_n( &grep.cancel, __ATOMIC_RELAXED))
+      break;  //扫描被打断，这个分片的结果不完整，不发布
+    __atomic_store_n( &grep.shards[k].done, 1, __ATOMIC_RELEASE);
+    event_wake();
+  }
+  return NULL;
+}
+
+//让工作线程尽快结束并等待它们
+void grep_stop(){
+  int i = -1;
+  __atomic_store_n( &grep.cancel, 1, __ATOMIC_RELAXED);
+  for( i = 0; i < grep.running; ++i)
+    pthread_join( grep.threads[i], NULL);
+  grep.stopped = grep.running > 0 && grep.merged < grep.shard_count;
+  grep.running = 0;
+  grep.cancel = 0;
+}
+
+//在消息栏显示匹配的行数和扫描进度
+void grep_update_info(){
+  if( grep.running)
+    snprintf( text.message, sizeof( text.message), "Grep /%.40s/: %d lines (%d%%, Ctrl-G to stop)",
+      grep.pattern, grep.count, grep.merged * 100 / grep.shard_count);
+  else
+    snprintf( text.message, sizeof( text.message), "Grep /%.40s/: %d lines%s (ESC or Enter to leave)",
+      grep.pattern, grep.count, grep.stopped ? ", stopped" : "");
+}
+
+//主线程每帧调用：把从头开始连续完成的分片的匹配行号接到列表末尾，全部完成后回收工作线程
+void grep_sync(){
+  if( !grep.active)
+    return;
+  while( grep.merged < grep.shard_count && __atomic_load_n( &grep.shards[grep.merged].done, __ATOMIC_ACQUIRE)){
+    Grep_shard* sh = &grep.shards[grep.merged++];
+    if( grep.count + sh->count > grep.cap){
+      grep.cap = ( grep.count + sh->count) * 2;
+      grep.rows = realloc( grep.rows, sizeof( int) * grep.cap);
+      if( grep.rows == NULL)
+        error_information( "realloc");
+    }
+    if( sh->count)
+      memcpy( grep.rows + grep.count, sh->rows, sizeof( int) * sh->count);
+    grep.count += sh->count;
+    free( sh->rows);
+    sh->rows = NULL;
+  }
+  if( grep.running && grep.merged == grep.shard_count)
+    grep_stop();
+  grep_update_info();
+}
+
+//进入grep视图并开始扫描，正则表达式有错时返回-1并在消息栏显示原因
+int grep_begin( const char* pattern){
+  int n = search.thread_count, i = -1;
+  for( i = 0; i < n; ++i){
+    int err = regcomp( &grep.re[i], pattern, REG_EXTENDED | REG_NEWLINE);
+    if( err != 0){
+      char msg[80];
+      regerror( err, &grep.re[i], msg, sizeof( msg));
+      snprintf( text.message, sizeof( text.message), "Bad pattern: %s", msg);
+      while( i-- > 0)
+        regfree( &grep.re[i]);
+      return -1;
+    }
+  }
+  grep.re_count = n;
+  snprintf( grep.pattern, sizeof( grep.pattern), "%s", pattern);
+  grep.map = text.buf->map;
+  grep.seg_count = grep.shard_count = 0;
+  grep_build();
+  grep.active = 1;
+  grep.merged = grep.count = 0;
+  grep.cur = grep.off = 0;
+  grep.next_shard = 0;
+  grep.stopped = 0;
+  text.shadow_valid = 0;  //屏幕行和文件行的对应关系变了，完整重画
+  for( i = 0; i < n && i < grep.shard_count; ++i){
+    if( pthread_create( &grep.threads[i], NULL, grep_worker, &grep.re[i]) != 0)
+      error_information( "pthread_create");
+    grep.running++;
+  }
+  grep_sync();
+  return 0;
+}
+
+//离开grep视图：停止扫描，释放分片和列表，光标留在当前的匹配行
+void grep_end(){
+  int i = -1;
+  if( !grep.active)
+    return;
+  grep_stop();
+  for( i = 0; i < grep.seg_count; ++i)
+    free( grep.segs[i].rows);
+  for( i = 0; i < grep.shard_count; ++i)
+    free( grep.shards[i].rows);
+  for( i = 0; i < grep.re_count; ++i)
+    regfree( &grep.re[i]);
+  grep.seg_count = grep.shard_count = grep.re_count = 0;
+  free( grep.rows);
+  grep.rows = NULL;
+  grep.count = grep.cap = 0;
+  grep.active = 0;
+  text.message[0] = '\0';
+  text.shadow_valid = 0;
+}
+
+//grep视图中的按键：ESC和回车离开视图，Ctrl-G停止扫描，已经停了时离开视图，返回1表示按键已处理
+//移动光标的键照常处理；其他键先离开视图再照常处理
+int grep_key( int c){
+  if( c == '\x1b' || c == '\r' || ( c == WITH_CTRL('g') && !grep.running)){
+    grep_end();
+    return 1;
+  }
+  if( c == WITH_CTRL('g')){
+    grep_stop();
+    grep_sync();
+    return 1;
+  }
+  if( c == ARROW_UP || c == ARROW_DOWN || c == ARROW_LEFT || c == ARROW_RIGHT || c == PAGE_UP || c == PAGE_DOWN
+    || c == HOME_KEY || c == END_KEY || c == WITH_CTRL('q'))
+    return 0;
+  grep_end();
+  return 0;
+}
+
+//Ctrl-G：输入正则表达式，进入grep视图
+void text_grep(){
+  if( !text.buf->index_done){  //还没加载完的部分不在片段树中
+    snprintf( text.message, sizeof( text.message), "Still loading, grep again when loading finishes");
+    return;
+  }
+  char* pattern = text_prompt( "Grep: %s (POSIX regex, ESC to cancel)", NULL);
+  if( pattern == NULL)
+    return;
+  grep_begin( pattern);
+  free( pattern);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*** file i/o ***/
+//打开读取文件
+//普通文件通过mmap映射，只在需要时建立行索引；管道等无法映射的文件读入内存后同样处理
+//同一个文件(dev/ino/size/mtime都相同)已经在别的缓冲区打开时，直接共享它的映射和行索引，不再扫描
+
+//新建一个还没有内容的文件
+Text_file* text_file_new(){
+  Text_file* f = calloc( 1, sizeof( Text_file));
+  if( f == NULL)
+    error_information( "calloc");
+  f->map_fd = -1;
+  f->loader_joined = 1;
+  f->watch = f->dir_watch = -1;
+  f->index_fd = -1;
+  return f;
+}
+
+//在已打开的文件中找和st是同一个文件的，没有时返回NULL
+Text_file* text_file_find( const struct stat* st){
+  Text_file* f = NULL;
+  for( f = text.files; f; f = f->next)
+    if( f->shared && f->dev == st->st_dev && f->ino == st->st_ino && f->size == st->st_size
+      && f->mtime.tv_sec == st->st_mtim.tv_sec && f->mtime.tv_nsec == st->st_mtim.tv_nsec)
+      return f;
+  return NULL;
+}
+
+//去掉一个引用，最后一个缓冲区关闭时停止加载线程，释放行索引和映射
+void text_file_release( Text_file* f){
+  if( --f->refs > 0)
+    return;
+  if( f->follow)
+    follow_stop( f);
+  if( !f->loader_joined){
+    __atomic_store_n( &f->load_stop, 1, __ATOMIC_RELAXED);
+    pthread_join( f->loader, NULL);
+  }
+  Text_file** p = &text.files;
+  while( *p != f)
+    p = &( *p)->next;
+  *p = f->next;
+
+  size_t i = 0;
+  for( i = 0; f->line_chunks && i < f->line_chunk_count; ++i){
+    char* c = ( char*)f->line_chunks[i];
+    if( f->index_map == NULL || c < f->index_map || c >= f->index_map + f->index_map_size)
+      free( c);  //来自缓存的块在映射中
+  }
+  free( f->line_chunks);
+  if( f->index_map)
+    munmap( f->index_map, f->index_map_size);
+  free( f->index_path);
+  free( f->index_key);
+  free( f->index_tmp);
+  if( f->map_owned)
+    free( f->map);
+  else if( f->map)
+    munmap( f->map, f->map_size);
+  if( f->map_fd != -1)
+    close( f->map_fd);
+  free( f);
+}
+
+//当前缓冲区改为显示文件f，行在text_load_sync中接入片段树
+void text_attach_file( Text_file* f){
+  if( f->refs++ == 0){
+    f->next = text.files;
+    text.files = f;
+    if( f->line_chunks == NULL) //从缓存得到了行索引时不需要扫描
+      text_load_start( f);  //行索引在后台建立，主循环同时继续处理输入和刷新屏幕
+  }
+  text.buf->file = f;
+  text.buf->map = f->map;
+  text.buf->map_size = f->map_size;
+  text.buf->map_fd = f->map_fd;
+  text.buf->line_chunks = f->line_chunks;
+  text.buf->line_count = 0;
+  text.buf->index_done = 0;
+}
+
+//把内存中的内容作为当前缓冲区的文件，data由文件接管，测试时使用
+void text_open_memory( char* data, size_t size){
+  Text_file* f = text_file_new();
+  f->map = data;
+  f->map_size = size;
+  f->map_owned = 1;
+  text_attach_file( f);
+}
+
+//在当前(空的)缓冲区中打开文件，打不开时返回-1，errno说明原因
+int text_open( char* filename){
+  int fd = open( filename, O_RDONLY);
+  if( fd == -1)
+    return -1;
+
+  struct stat st;
+  if( fstat( fd, &st) == -1){
+    close( fd);
+    return -1;
+  }
+
+  Text_file* f = S_ISREG( st.st_mode) && st.st_size > 0 ? text_file_find( &st) : NULL;
+  if( f){
+    close( fd);
+  } else {
+    f = text_file_new();
+    if( S_ISREG( st.st_mode) && st.st_size > 0){
+      f->map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if( f->map == MAP_FAILED){ //映射不了(例如地址空间不够)时和打不开一样返回，由调用者提示
+        int e = errno;
+        close( fd);
+        free( f);
+        errno = e;
+        return -1;
+      }
+      f->map_size = st.st_size;
+      madvise( f->map, f->map_size, MADV_SEQUENTIAL);
+        //告诉内核将顺序访问，加大预读
+      f->shared = 1;
+    } else if( !S_ISREG( st.st_mode)){
+      size_t cap = 0;
+      ssize_t n;
+      f->map_owned = 1;
+      do {
+        if( f->map_size == cap){
+          cap = cap ? cap * 2 : 65536;
+          char* new_ = realloc( f->map, cap);
+          if( new_ == NULL)
+            error_information( "realloc");
+          f->map = new_;
+        }
+        n = read( fd, f->map + f->map_size, cap - f->map_size);
+        if( n == -1 && errno != EINTR){
+          int e = errno;
+          close( fd);
+          free( f->map);
+          free( f);
+          errno = e;
+          return -1;
+        }
+        if( n > 0)
+          f->map_size += n;
+      } while( n != 0);
+    }
+    if( S_ISREG( st.st_mode)){
+      f->map_fd = fd; //保存时从这里直接复制未修改的内容，跟随文件时从这里得到新的长度
+      f->dev = st.st_dev;
+      f->ino = st.st_ino;
+      f->size = st.st_size;
+      f->mtime = st.st_mtim;
+      index_cache_open( f, filename);
+    } else {
+      close( fd);
+    }
+  }
+  text_attach_file( f);
+
+  free( text.buf->filename);
+  text.buf->filename = strdup( filename);
+  text_select_syntax();
+  return 0;
+}
+
+//关闭当前缓冲区的文件：片段、编辑过的行和列检查点随两个arena一次释放，不逐行释放；文件没有别的缓冲区使用时才释放
+void text_close(){
+  text_save_wait(); //保存线程还在读映射
+  if( text.buf->row_cache)
+    row_cache_reset();  //缓存中的列检查点也在arena中，先清掉引用
+  undo_reset();
+  arena_release( &text.buf->arena);
+  arena_release( &text.buf->grow);
+  text.buf->rows = NULL;
+  text.buf->number_rows = 0;
+  hl_lines_free();
+  text.buf->hl_private = 0;
+
+  if( text.buf->file)
+    text_file_release( text.buf->file);
+  text.buf->file = NULL;
+  text.buf->line_chunks = NULL;
+  text.buf->line_count = 0;
+  text.buf->index_done = 1;
+  text.buf->map = NULL;
+  text.buf->map_size = 0;
+  text.buf->map_fd = -1;
+  free( text.buf->filename);
+  text.buf->filename = NULL;
+  text.buf->syntax = NULL;
+  text.buf->hl_dirty = INT_MAX;
+  text.buf->cursor_x = text.buf->cursor_y = 0;
+  text.buf->row_off = text.buf->col_off = 0;
+  text.shadow_valid = 0;
+}
+
+//保存计划中追加一段，和上一段在同一来源中首尾相接时合并
+void save_add_span( int from_map, size_t off, size_t len){
+  if( len == 0)
+    return;
+  if( save.span_count > 0){
+    Save_span* last = &save.spans[save.span_count - 1];
+    if( last->from_map == from_map && last->off + last->len == off){
+      last->len += len;
+      return;
+    }
+  }
+  if( save.span_count == save.span_cap){
+    save.span_cap = save.span_cap ? save.span_cap * 2 : 256;
+    save.spans = realloc( save.spans, sizeof( Save_span) * save.span_cap);
+    if( save.spans == NULL)
+      error_information( "realloc");
+  }
+  Save_span* sp = &save.spans[save.span_count++];
+  sp->from_map = from_map;
+  sp->off = off;
+  sp->len = len;
+}
+
+//编辑过的行复制到快照后加入保存计划
+void save_add_edited( const char* s, size_t len){
+  size_t off = save.edited.len;
+  string_buff_append( &save.edited, s, len);
+  save_add_span( 0, off, len);
+}
+
+//按行号顺序遍历片段树生成保存计划：原始行是映射中的字节范围(带原来的行尾)，编辑过的行复制一份
+void save_collect( Row_piece* t, int* row){
+  if( !t)
+    return;
+  save_collect( t->left, row);
+  if( t->row){
+    save_add_edited( t->row->one_row_string, t->row->size);
+    if( save.final_eol || *row + 1 < text.buf->number_rows)
+      save_add_edited( save.eol, strlen( save.eol));
+  } else {
+    int last = t->first + t->lines - 1;
+    size_t start = line_start_at( t->first);
+    size_t end = line_start_at( last) + line_len_at( last) + line_eol_len( line_flags_at( last));
+    save_add_span( 1, start, end - start);
+    if( !( line_flags_at( last) & ROW_EOL_LF) && *row + t->lines < text.buf->number_rows)
+      save_add_edited( save.eol, strlen( save.eol)); //原文件最后一行没有换行，后面又加了行
+  }
+  *row += t->lines;
+  save_collect( t->right, row);
+}
+
+//在主线程中生成保存计划，之后后台线程只读映射和快照，主线程可以继续编辑
+void save_plan(){
+  int row = 0;
+  save.span_count = 0;
+  save.edited.len = 0;
+  save.map = text.buf->map;
+  save.eol = text.buf->line_count > 0 && ( line_flags_at( 0) & ROW_EOL_CR) ? "\r\n" : "\n"; //新行沿用文件原来的行尾
+  save.final_eol = text.buf->line_count == 0 || ( line_flags_at( text.buf->line_count - 1) & ROW_EOL_LF);
+  save_collect( text.buf->rows, &row);
+  save.total = 0;
+  int i = -1;
+  for( i = 0; i < save.span_count; ++i)
+    save.total += save.spans[i].len;
+}
+
+//把iov中的n段全部写出，处理部分写入
+int save_writev( int fd, struct iovec* iov, int n){
+  while( n > 0){
+    ssize_t w = writev( fd, iov, n);
+    if( w == -1 && errno == EINTR)
+      continue;
+    if( w <= 0)
+      return -1;
+    while( n > 0 && ( size_t)w >= iov->iov_len){
+      w -= iov->iov_len;
+      ++iov;
+      --n;
+    }
+    if( n > 0){
+      iov->iov_base = ( char*)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
+
+//把原文件[off, off + len)在内核中直接复制到fd，不经过用户空间；不支持时返回-1并设置errno
+int save_copy_range( int fd, size_t off, size_t len){
+  loff_t in = off;
+  while( len > 0){
+    ssize_t n = copy_file_range( save.src_fd, &in, fd, NULL, len, 0);
+    if( n == -1 && errno == EINTR)
+      continue;
+    if( n <= 0)
+      return -1;
+    len -= n;
+  }
+  return 0;
+}
+
+//按计划写出到fd：大段原始内容用copy_file_range，其余的(小段原始内容直接指向映射)攒成writev
+//每写SAVE_SYNC_BYTES就让内核开始回写，最后的fsync不必一次刷出几GB的脏页
+int save_write_spans( int fd){
+  struct iovec iov[SAVE_IOV];
+  int n = 0;
+  size_t written = 0, synced = 0;
+  int i = -1;
+  for( i = 0; i < save.span_count; ++i){
+    Save_span* sp = &save.spans[i];
+    int copied = 0;
+    if( sp->from_map && save.use_copy && save.src_fd != -1 && sp->len >= SAVE_COPY_MIN){
+      if( save_writev( fd, iov, n) == -1)
+        return -1;
+      n = 0;
+      off_t pos = lseek( fd, 0, SEEK_CUR);
+      copied = save_copy_range( fd, sp->off, sp->len) == 0;
+      if( !copied){
+        if( errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+          return -1;
+        save.use_copy = 0;  //文件系统不支持时退回到writev，已复制的部分重新写
+        if( pos == -1 || lseek( fd, pos, SEEK_SET) == -1)
+          return -1;
+      }
+    }
+    written += sp->len;
+    if( !copied){ //小段原始内容直接指向映射，不复制
+      iov[n].iov_base = ( void*)( ( sp->from_map ? save.map : save.edited.b) + sp->off);
+      iov[n].iov_len = sp->len;
+      ++n;
+      if( n == SAVE_IOV || written - synced >= SAVE_SYNC_BYTES){
+        if( save_writev( fd, iov, n) == -1)
+          return -1;
+        n = 0;
+      }
+    }
+    if( n == 0 && written - synced >= SAVE_SYNC_BYTES){
+      sync_file_range( fd, synced, written - synced, SYNC_FILE_RANGE_WRITE);
+      synced = written;
+    }
+  }
+  return save_writev( fd, iov, n);
+}
+
+//保存线程：写到同一目录下的临时文件，fsync后rename覆盖原文件，再fsync目录
+//中途出错或崩溃时原文件保持不变
+void* save_worker( void* arg){
+  ( void)arg;
+  long long t0 = now_ns();
+  int err = 0;
+  size_t len = strlen( save.path);
+  char* tmp = malloc( len + 8);
+  if( tmp == NULL){
+    err = ENOMEM;
+    goto out;
+  }
+  memcpy( tmp, save.path, len);
+  memcpy( tmp + len, ".XXXXXX", 8);
+  int fd = mkstemp( tmp);
+  if( fd == -1){
+    err = errno;
+    goto out;
+  }
+  struct stat st;
+  fchmod( fd, stat( save.path, &st) == 0 ? st.st_mode & 07777 : 0644);  //保持原文件的权限
+  if( save_write_spans( fd) == -1 || fsync( fd) == -1)
+    err = errno;
+  if( close( fd) == -1 && err == 0)
+    err = errno;
+  if( err == 0 && rename( tmp, save.path) == -1)
+    err = errno;
+  if( err){
+    unlink( tmp);
+    goto out;
+  }
+
+  char* slash = strrchr( save.path, '/');  //rename本身也要落盘
+  if( slash)
+    *slash = '\0';
+  int dir = open( slash ? ( slash == save.path ? "/" : save.path) : ".", O_RDONLY | O_DIRECTORY);
+  if( slash)
+    *slash = '/';
+  if( dir != -1){
+    fsync( dir);
+    close( dir);
+  }
+out:
+  free( tmp);
+  save.error = err;
+  save.ns = now_ns() - t0;
+  __atomic_store_n( &save.done, 1, __ATOMIC_RELEASE);
+  event_wake();
+  return NULL;
+}
+
+//主线程调用：保存线程结束后回收线程并显示结果
+void text_save_sync(){
+  if( !save.running || !__atomic_load_n( &save.done, __ATOMIC_ACQUIRE))
+    return;
+  pthread_join( save.thread, NULL);
+  save.running = 0;
+  if( save.error)
+    snprintf( text.message, sizeof( text.message), "Can't save! I/O error: %s", strerror( save.error));
+  else
+    snprintf( text.message, sizeof( text.message), "%zu bytes written to disk in %.1f ms", save.total, save.ns / 1e6);
+}
+
+//等待正在进行的保存完成，关闭文件和退出前调用
+void text_save_wait(){
+  if( !save.running)
+    return;
+  pthread_join( save.thread, NULL);
+  save.done = 1;
+  text_save_sync();
+}
+
+//Ctrl-S：在主线程生成保存计划后交给保存线程，界面继续响应
+void text_save(){
+  if( save.running){
+    snprintf( text.message, sizeof( text.message), "Save in progress...");
+    return;
+  }
+  if( !text.buf->index_done){  //还没加载完的部分不在片段树中
+    snprintf( text.message, sizeof( text.message), "Still loading, save again when loading finishes");
+    return;
+  }
+  if( text.buf->filename == NULL){
+    char* name = text_prompt( "Save as: %s (ESC to cancel)", NULL);
+    if( name == NULL){
+      snprintf( text.message, sizeof( text.message), "Save aborted");
+      return;
+    }
+    text.buf->filename = name;
+    text_select_syntax();
+  }
+  if( text.buf->file && text.buf->file->follow){
+    follow_stop( text.buf->file); //保存后路径上是新的文件，原来的映射不会再变长
+    snprintf( text.message, sizeof( text.message), "Saving stops following the file");
+  }
+
+  save_plan();
+  free( save.path);
+  save.path = strdup( text.buf->filename);
+  if( save.path == NULL)
+    error_information( "strdup");
+  save.src_fd = text.buf->map_fd;
+  save.use_copy = 1;
+  save.done = 0;
+  save.error = 0;
+  if( pthread_create( &save.thread, NULL, save_worker, NULL) != 0)
+    error_information( "pthread_create");
+  save.running = 1;
+  snprintf( text.message, sizeof( text.message), "Saving %.100s...", text.buf->filename);
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*** buffers ***/
+//每个打开的文件一个缓冲区，text.buf指向当前的一个，切换只改变这个指针和撤销日志，不重新加载
+//打开同一个文件的缓冲区共享映射和行索引；最近没用的缓冲区释放行缓存和列检查点，切换回来时按需重建
+
+//新建一个空的缓冲区，加到缓冲区列表末尾，不改变当前缓冲区
+struct Text_buffer* buffer_new(){
+  struct Text_buffer* b = calloc( 1, sizeof( struct Text_buffer));
+  if( b == NULL)
+    error_information( "calloc");
+  b->map_fd = -1;
+  b->index_done = 1;  //没有打开文件时没有需要索引的内容
+  b->hl_dirty = INT_MAX;
+  b->undo.limit = undo.limit;
+  if( text.buffer_count == text.buffer_cap){
+    text.buffer_cap = text.buffer_cap ? text.buffer_cap * 2 : 8;
+    text.buffers = realloc( text.buffers, sizeof( struct Text_buffer*) * text.buffer_cap);
+    if( text.buffers == NULL)
+      error_information( "realloc");
+  }
+  text.buffers[text.buffer_count++] = b;
+  return b;
+}
+
+//释放编辑过的行的列检查点
+void piece_drop_marks( Row_piece* t){
+  if( !t)
+    return;
+  piece_drop_marks( t->left);
+  piece_drop_marks( t->right);
+  if( t->row && t->row->col_marks){
+    arena_free( &text.buf->grow, t->row->col_marks, t->row->col_mark_cap * sizeof( int));
+    t->row->col_marks = NULL;
+    t->row->col_mark_count = t->row->col_mark_cap = 0;
+  }
+}
+
+//释放不活动的缓冲区b的行缓存和列检查点，它们都可以从映射和行内容重新算出
+void buffer_drop_caches( struct Text_buffer* b){
+  struct Text_buffer* cur = text.buf;
+  text.buf = b; //下面的函数都作用于当前缓冲区
+  row_cache_reset();
+  piece_drop_marks( b->rows);
+  free( b->row_cache);
+  free( b->row_bucket);
+  b->row_cache = NULL;
+  b->row_bucket = NULL;
+  text.buf = cur;
+}
+
+//只让最近用过的BUFFER_CACHED个缓冲区保留缓存
+void buffer_trim_caches(){
+  int cached = 0, i = -1;
+  for( i = 0; i < text.buffer_count; ++i)
+    cached += text.buffers[i]->row_cache != NULL;
+  while( cached > BUFFER_CACHED){
+    struct Text_buffer* oldest = NULL;
+    for( i = 0; i < text.buffer_count; ++i){
+      struct Text_buffer* b = text.buffers[i];
+      if( b != text.buf && b->row_cache && ( oldest == NULL || b->used < oldest->used))
+        oldest = b;
+    }
+    buffer_drop_caches( oldest);
+    --cached;
+  }
+}
+
+//切换到缓冲区b：交换撤销日志，需要时重建行缓存，行索引和片段树原样保留
+void buffer_switch( struct Text_buffer* b){
+  if( text.buf == b)
+    return;
+  if( text.buf)
+    text.buf->undo = undo;
+  undo = b->undo;
+  text.buf = b;
+  b->used = ++text.buffer_clock;
+  text.shadow_valid = 0;  //换了缓冲区，屏幕上的内容和shadow_row_off都不再对应，完整重画
+  if( b->row_cache == NULL){
+    b->row_cache = calloc( ROW_CACHE_SIZE, sizeof( Row_cache_entry));
+    b->row_bucket = malloc( sizeof( int) * ROW_CACHE_BUCKETS);
+    if( b->row_cache == NULL || b->row_bucket == NULL)
+      error_information( "malloc");
+    row_cache_reset();
+  }
+  buffer_trim_caches();
+  text_load_sync(); //不活动时文件可能追加过内容，先换上新的映射和行索引
+}
+
+//缓冲区b有没有编辑过(撤销日志不为空)，当前缓冲区的日志在全局的undo中
+int buffer_edited( struct Text_buffer* b){
+  return ( b == text.buf ? undo.count : b->undo.count) > 0;
+}
+
+//当前缓冲区在列表中的位置
+int buffer_index(){
+  int i = -1;
+  for( i = 0; i < text.buffer_count; ++i)
+    if( text.buffers[i] == text.buf)
+      return i;
+  return -1;
+}
+
+//在新的缓冲区中打开文件并切换过去；当前缓冲区是没有名字也没有内容的空缓冲区时直接使用它
+//打不开时回到原来的缓冲区，返回-1
+int buffer_open( char* filename){
+  struct Text_buffer* prev = text.buf;
+  int reuse = text.buf->filename == NULL && text.buf->file == NULL && text.buf->number_rows == 0;
+  if( !reuse)
+    buffer_switch( buffer_new());
+  if( text_open( filename) == 0)
+    return 0;
+  int saved_errno = errno;
+  if( !reuse)
+    buffer_close();
+  buffer_switch( prev);
+  errno = saved_errno;
+  return -1;
+}
+
+//关闭当前缓冲区，切换到列表中的前一个；最后一个缓冲区只清空不删除
+void buffer_close(){
+  int i = buffer_index();
+  text_close();
+  if( text.buffer_count == 1)
+    return;
+  struct Text_buffer* b = text.buf;
+  if( b->row_cache)
+    buffer_drop_caches( b);
+  memmove( &text.buffers[i], &text.buffers[i + 1], sizeof( struct Text_buffer*) * ( text.buffer_count - i - 1));
+  --text.buffer_count;
+  free( undo.ops); //撤销日志的内容已在text_close中释放
+  text.buf = NULL;
+  buffer_switch( text.buffers[i > 0 ? i - 1 : 0]);
+  free( b);
+}
+
+//Ctrl-N / Ctrl-P：切换到后一个或前一个缓冲区
+void buffer_next( int dir){
+  if( text.buffer_count < 2)
+    return;
+  int i = ( buffer_index() + dir + text.buffer_count) % text.buffer_count;
+  buffer_switch( text.buffers[i]);
+  snprintf( text.message, sizeof( text.message), "[%d/%d] %.100s", i + 1, text.buffer_count,
+    text.buf->filename ? text.buf->filename : "[No Name]");
+}
+
+//Ctrl-O：在新的缓冲区中打开文件
+void buffer_prompt_open(){
+  char* name = text_prompt( "Open: %s (ESC to cancel)", NULL);
+  if( name == NULL)
+    return;
+  if( buffer_open( name) == -1)
+    snprintf( text.message, sizeof( text.message), "Can't open %.80s: %s", name, strerror( errno));
+  else
+    snprintf( text.message, sizeof( text.message), "[%d/%d] %.100s", buffer_index() + 1, text.buffer_count, name);
+  free( name);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*** follow ***/
+//跟随文件(tail -f)：inotify报告文件或所在目录有变化时只记下来，下一帧开始时在follow_sync中处理
+//文件变长时扩大映射，只为新追加的字节建立索引并接到片段树末尾；被截断或被轮转(路径上换成了新文件)时重新打开
+
+//开始跟随文件f，path是打开它时用的路径；不是普通文件时返回-1
+int follow_start( Text_file* f, const char* path){
+  if( f->map_owned || f->map_fd == -1 || path == NULL){
+    errno = ESPIPE;
+    return -1;
+  }
+  if( text.inotify_fd == -1){
+    text.inotify_fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC);
+    if( text.inotify_fd == -1)
+      return -1;
+    event_add( text.inotify_fd, follow_on_event);
+  }
+  f->watch = inotify_add_watch( text.inotify_fd, path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+  if( f->watch == -1)
+    return -1;
+  f->path = strdup( path);
+  if( f->path == NULL)
+    error_information( "strdup");
+  char* slash = strrchr( f->path, '/');
+  f->name = slash ? slash + 1 : f->path;
+  if( slash){ //日志轮转时新文件出现在同一个目录中
+    char c = slash[slash == f->path];
+    slash[slash == f->path] = '\0';
+    f->dir_watch = inotify_add_watch( text.inotify_fd, f->path, IN_CREATE | IN_MOVED_TO);
+    slash[slash == f->path] = c;
+  } else {
+    f->dir_watch = inotify_add_watch( text.inotify_fd, ".", IN_CREATE | IN_MOVED_TO);
+  }
+  f->follow = 1;
+  f->follow_pending = 1;  //打开之后可能已经有了新内容
+  return 0;
+}
+
+//停止跟随文件f；目录的监视可能和其他跟随的文件共用，没有文件再用时才移除
+//文件的监视也可能共用：截断后重新打开同一个inode时，内核返回的是同一个监视
+void follow_stop( Text_file* f){
+  Text_file* g = NULL;
+  int shared = 0, shared_watch = 0;
+  for( g = text.files; g; g = g->next){
+    shared |= g != f && g->follow && g->dir_watch == f->dir_watch;
+    shared_watch |= g != f && g->follow && g->watch == f->watch;
+  }
+  if( f->watch != -1 && !shared_watch)
+    inotify_rm_watch( text.inotify_fd, f->watch);
+  if( f->dir_watch != -1 && !shared)
+    inotify_rm_watch( text.inotify_fd, f->dir_watch);
+  f->watch = f->dir_watch = -1;
+  free( f->path);
+  f->path = NULL;
+  f->name = NULL;
+  f->follow = 0;
+  f->follow_pending = 0;
+}
+
+//inotify可读：找出有变化的文件，标记为待处理
+void follow_on_event( int fd){
+  union {
+    struct inotify_event e; //保证缓冲区按事件结构对齐
+    char b[4096];
+  } buf;
+  ssize_t n;
+  while( ( n = read( fd, buf.b, sizeof( buf.b))) > 0){
+    TRACE_SYSCALL();
+    char* p = buf.b;
+    while( p < buf.b + n){
+      const struct inotify_event* e = ( const struct inotify_event*)p;
+      Text_file* f = NULL;
+      for( f = text.files; f; f = f->next){
+        if( !f->follow)
+          continue;
+        if( ( e->mask & IN_Q_OVERFLOW) || e->wd == f->watch
+          || ( e->wd == f->dir_watch && e->len > 0 && strcmp( e->name, f->name) == 0))
+          f->follow_pending = 1;
+        if( e->wd == f->watch && ( e->mask & IN_IGNORED))
+          f->watch = -1;  //文件被删除，监视已经被内核移除
+      }
+      p += sizeof( struct inotify_event) + e->len;
+    }
+  }
+  TRACE_SYSCALL();
+}
+
+//文件变长：扩大映射和块目录，重新扫描原来没有行尾的最后一行，再为新内容建立索引
+//新内容不多时直接在主线程扫描，这一帧就能显示；多时交给加载线程，和打开文件时一样分批显示
+void follow_append( Text_file* f, const struct stat* st){
+  size_t size = st->st_size;
+  char* map = f->map ? mremap( f->map, f->map_size, size, MREMAP_MAYMOVE)
+    : mmap( NULL, size, PROT_READ, MAP_PRIVATE, f->map_fd, 0);
+  if( map == MAP_FAILED){
+    snprintf( text.message, sizeof( text.message), "Can't map the new data: %s", strerror( errno));
+    return;
+  }
+  f->map = map;
+  f->map_size = size;
+  f->shared = 1;
+  f->size = st->st_size;
+  f->mtime = st->st_mtim;
+
+  size_t need = ( size + 1) / LINE_CHUNK + 2;
+  if( need > f->line_chunk_count){
+    Line_chunk** chunks = realloc( f->line_chunks, sizeof( Line_chunk*) * need);
+    if( chunks == NULL)
+      error_information( "realloc");
+    memset( chunks + f->line_chunk_count, 0, sizeof( Line_chunk*) * ( need - f->line_chunk_count));
+    f->line_chunks = chunks;
+    f->line_chunk_count = need;
+  }
+
+  const char* q = f->map + f->load_off;
+  const char* end = f->map + size;
+  int count = f->loaded_lines;
+  if( count > 0){
+    Line_chunk* c = f->line_chunks[( count - 1) >> LINE_CHUNK_SHIFT];
+    int i = ( count - 1) & ( LINE_CHUNK - 1);
+    if( !( c->flags[i] & ROW_EOL_LF) && c->len[i] < LINE_LEN_MAX){
+      //最后一行没有行尾，可能是写了一半的行：从它的开始重新扫描，行号不变
+      q -= c->len[i];
+      q = line_index_next( f, count - 1, q, end);
+    }
+  }
+  if( end - q <= FOLLOW_SYNC_BYTES){
+    while( q < end)
+      q = line_index_next( f, count++, q, end);
+    f->load_off = q - f->map;
+    f->loaded_lines = count;
+  } else {
+    f->load_off = q - f->map;
+    text_load_continue( f);
+  }
+  f->appends++;
+}
+
+//文件被截断、路径上换成了别的文件或缓存的行索引过时：打开它的缓冲区都重新打开这个路径，跟随的文件继续跟随
+//编辑过的缓冲区不重新打开，留在原来的映射上，不丢掉编辑和撤销日志；这时停止跟随f，以免每次变化都再提示
+void follow_reload( Text_file* f, const char* why){
+  struct Text_buffer* cur = text.buf;
+  int i = -1, kept = 0;
+  f->refs++;  //循环中f不能被释放，新打开的文件也不会和它混淆
+  for( i = 0; i < text.buffer_count; ++i){
+    if( text.buffers[i]->file != f)
+      continue;
+    if( buffer_edited( text.buffers[i])){
+      snprintf( text.message, sizeof( text.message), "%.60s was %s on disk, kept your edits", text.buffers[i]->filename, why);
+      kept = 1;
+      continue;
+    }
+    buffer_switch( text.buffers[i]);
+    char* name = text.buf->filename;
+    text.buf->filename = NULL;
+    text_close();
+    if( text_open( name) == -1 || ( f->follow && !text.buf->file->follow && follow_start( text.buf->file, name) == -1)){
+      snprintf( text.message, sizeof( text.message), "Can't reopen %.60s: %s", name, strerror( errno));
+    } else {
+      snprintf( text.message, sizeof( text.message), "%.60s was %s, reloaded", name, why);
+    }
+    free( name);
+  }
+  struct stat st;
+  if( kept && fstat( f->map_fd, &st) == 0 && ( size_t)st.st_size < f->map_size){
+    //截断后原来映射中文件末尾之后的页一访问就是SIGBUS，换成全零的匿名页，编辑过的缓冲区还能显示和保存
+    size_t page = sysconf( _SC_PAGESIZE);
+    size_t from = ( st.st_size + page - 1) / page * page;
+    if( from < f->map_size
+      && mmap( f->map + from, f->map_size - from, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+      error_information( "mmap");
+  }
+  if( kept && f->follow)
+    follow_stop( f);
+  buffer_switch( cur);
+  text_file_release( f);
+}
+
+//检查一个有变化的文件，重新打开了时返回1
+int follow_check( Text_file* f){
+  struct stat st;
+  if( stat( f->path, &st) == 0 && ( st.st_dev != f->dev || st.st_ino != f->ino)){
+    follow_reload( f, "replaced");
+    return 1;
+  }
+  if( fstat( f->map_fd, &st) == -1)
+    return 0;
+  if( ( size_t)st.st_size < f->map_size){
+    follow_reload( f, "truncated");
+    return 1;
+  }
+  if( ( size_t)st.st_size > f->map_size)
+    follow_append( f, &st);
+  return 0;
+}
+
+//每帧开始时处理有变化的文件；加载线程、搜索或保存还在读映射时不能移动它，留到以后的帧
+void follow_sync(){
+  if( save.running || search.shard_count > 0 || grep.active)
+    return;
+  Text_file* f = text.files;
+  while( f){
+    if( !f->follow_pending || ( !f->loader_joined && !__atomic_load_n( &f->load_done, __ATOMIC_ACQUIRE))){
+      f = f->next;
+      continue;
+    }
+    if( !f->loader_joined)
+      pthread_join( f->loader, NULL);
+    f->loader_joined = 1;
+    f->follow_pending = 0;
+    f = follow_check( f) ? text.files : f->next; //重新打开后文件列表变了，从头再找
+  }
+}
+
+//Ctrl-L：开始或停止跟随当前文件
+void text_follow_toggle(){
+  Text_file* f = text.buf->file;
+  if( f && f->follow){
+    follow_stop( f);
+    snprintf( text.message, sizeof( text.message), "Stopped following");
+  } else if( f == NULL || follow_start( f, text.buf->filename) == -1){
+    snprintf( text.message, sizeof( text.message), "Can't follow this file: %s", strerror( errno));
+  } else {
+    snprintf( text.message, sizeof( text.message), "Following %.60s, Ctrl-L to stop", text.buf->filename);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*** input system ***/
+
+//方向键移动光标，只需要行长度，从索引得到，不实体化行
+//光标移到上一行(dir为-1)或下一行，grep视图中移到上一个或下一个匹配行；移动了返回1
+int cursor_step( int dir){
+  if( grep.active){
+    if( grep.cur + dir < 0 || grep.cur + dir >= grep.count)
+      return 0;
+    grep.cur += dir;
+    text.buf->cursor_y = grep.rows[grep.cur];
+    return 1;
+  }
+  if( dir < 0){
+    if( text.buf->cursor_y == 0)
+      return 0;
+    --text.buf->cursor_y;
+    return 1;
+  }
+  if( text.buf->cursor_y >= text.buf->number_rows - ( text.buf->index_done ? 0 : 1)) //加载完成前不能移到文件末尾之后
+    return 0;
+  ++text.buf->cursor_y;
+  return 1;
+}
+
+void move_cursor( int key){
+  int row_len = ( text.buf->cursor_y >= text.buf->number_rows) ? -1 : text_row_size( text.buf->cursor_y);
+    //检查光标是否在实际行上，不在时为-1
+  
+  if( key == ARROW_UP){ //上箭头 Ctrl-J
+    cursor_step( -1);
+  } else if( key == ARROW_DOWN){ //下箭头 Ctrl-K
+    cursor_step( 1);
+  } else if( key == ARROW_RIGHT){ //右箭头 Ctrl-L
+    if( row_len >= 0 && text.buf->cursor_x < row_len){
+      text.buf->cursor_x = text_row_next_char( text.buf->cursor_y, text.buf->cursor_x);  //多字节字符整个跨过
+    } else if( row_len >= 0 && text.buf->cursor_x == row_len){
+      if( cursor_step( 1))
+        text.buf->cursor_x = 0;
+    }
+  } else if( key == ARROW_LEFT){  //左箭头 Ctrl-H
+    if( text.buf->cursor_x != 0){
+    text.buf->cursor_x = text_row_prev_char( text.buf->cursor_y, text.buf->cursor_x);
+    } else if( cursor_step( -1)){  //左箭头到最前端且非首行时前往上一行末尾
+      text.buf->cursor_x = text_row_size( text.buf->cursor_y);
+    }
+  }
+  row_len = ( text.buf->cursor_y >= text.buf->number_rows) ? 0 : text_row_size( text.buf->cursor_y);
+  if( text.buf->cursor_x > row_len)
+    text.buf->cursor_x = row_len;
+  if( text.buf->cursor_y < text.buf->number_rows) //上下移动后可能落在多字节字符中间
+    text.buf->cursor_x = text_row_snap_char( text.buf->cursor_y, text.buf->cursor_x);
+}
+
+//把标准输入中现在可读的字节一次全部读进输入缓冲区，读到了返回1
+int input_read(){
+  if( text.in_start > 0){ //已解码的部分移走，剩下不完整的按键移到开头
+    memmove( text.in_buf, &text.in_buf[text.in_start], text.in_len);
+    text.in_start = 0;
+  }
+  if( text.in_len == INPUT_BUF_SIZE)
+    return 0;
+  ssize_t n = read( STDIN_FILENO, &text.in_buf[text.in_len], INPUT_BUF_SIZE - text.in_len);
+  TRACE_SYSCALL();
+  if( n == -1 && errno != EAGAIN && errno != EINTR)
+    error_information( "read");
+  if( n <= 0)
+    return 0;
+#ifdef KILO_TRACE
+  if( trace.input_ns == 0)  //记下输入到达的时间，画完下一帧时得到输入到绘制的延迟
+    trace.input_ns = now_ns();
+#endif
+  text.in_len += n;
+  return 1;
+}
+
+//从输入缓冲区去掉n个已解码的字节
+void input_consume( int n){
+  text.in_start += n;
+  text.in_len -= n;
+}
+
+//从输入缓冲区解码一个完整的按键，缓冲区为空或按键还不完整时返回KEY_NONE
+int input_decode(){
+  char* b = &text.in_buf[text.in_start];
+  int n = text.in_len;
+
+  if( text.pasting){
+    //括号粘贴模式：直到\x1b[201~之前的字节都是粘贴的文字，不解释成按键
+    while( n > 0){
+      char* esc = memchr( b, '\x1b', n);
+      int run = esc ? esc - b : n;
+      if( run > 0){
+        text.paste_ptr = b;
+        text.paste_len = run;
+        input_consume( run);
+        return PASTE_DATA;
+      }
+      if( n >= 6 && memcmp( b, "\x1b[201~", 6) == 0){
+        input_consume( 6);
+        return PASTE_END;
+      }
+      if( n < 6 && memcmp( b, "\x1b[201~", n) == 0)
+        return KEY_NONE;  //结束标记还没收全
+      input_consume( 1);  //粘贴内容中单独的ESC丢掉
+      ++b;
+      --n;
+    }
+    return KEY_NONE;
+  }
+
+  if( n == 0)
+    return KEY_NONE;
+  if( b[0] != '\x1b'){
+    input_consume( 1);
+    return ( unsigned char)b[0];
+  }
+  if( n < 3)
+    return KEY_NONE;  //转义序列还不完整，由调用者决定是继续等还是当作单独的ESC
+
+  if( b[1] == '['){
+    //CSI序列：\x1b[ 参数(数字和;) 结束字符
+    int i = 2;
+    while( i < n && i < 16 && ( isdigit( ( unsigned char)b[i]) || b[i] == ';'))
+      ++i;
+    if( i == n)
+      return KEY_NONE;
+    char final_ = b[i];
+    int param = atoi( &b[2]);
+    input_consume( i + 1);
+    if( final_ == '~'){
+      //Home 键可以作为 <esc>[1~、<esc>[7~、<esc>[H 或 <esc>OH 发送
+      if( param == 1 || param == 7)
+        return HOME_KEY;
+      //Delete: <esc>[3~
+      else if( param == 3)
+        return DEL_KEY;
+      //End 键可以作为 <esc>[4~、<esc>[8~、<esc>[F 或 <esc>OF 发送
+      else if( param == 4 || param == 8)
+        return END_KEY;
+      //Page Up 以 <esc>[5~ 发送，Page Down 以 <esc>[6~ 发送
+      else if( param == 5)
+        return PAGE_UP;
+      else if( param == 6)
+        return PAGE_DOWN;
+      //括号粘贴的开始: <esc>[200~
+      else if( param == 200)
+        return PASTE_START;
+      else if( param == 201)
+        return PASTE_END;
+    } else if( final_ == 'A')
+      return ARROW_UP;
+    else if( final_ == 'B')
+      return ARROW_DOWN;
+    else if( final_ == 'C')
+      return ARROW_RIGHT;
+    else if( final_ == 'D')
+      return ARROW_LEFT;
+    else if( final_ == 'H')
+      return HOME_KEY;
+    else if( final_ == 'F')
+      return END_KEY;
+    return '\x1b';
+  } else if( b[1] == 'O'){
+    input_consume( 3);
+    if( b[2] == 'H')
+      return HOME_KEY;
+    else if( b[2] == 'F')
+      return END_KEY;
+    return '\x1b';
+  }
+  input_consume( 1);
+  return '\x1b';
+}
+
+//从键盘读取字符：先从输入缓冲区解码，没有完整按键时才等待输入
+//阻塞在poll上直到标准输入可读；其他事件(加载进度、窗口大小改变)处理后返回KEY_NONE让主循环刷新屏幕
+int get_read_from_keyboard() {
+  while( 1){
+    int key = input_decode();
+    if( key != KEY_NONE)
+      return key;
+    if( text.in_len > 0 && text.in_buf[text.in_start] == '\x1b'){
+      //转义序列的后续字节最多等待ESC_TIMEOUT_MS，等不到就是单独按了ESC
+      struct pollfd pfd = { STDIN_FILENO, POLLIN, 0};
+      int ready = poll( &pfd, 1, ESC_TIMEOUT_MS);
+      TRACE_SYSCALL();
+      if( ready > 0 && input_read())
+        continue;
+      input_consume( 1);
+      return '\x1b';
+    }
+    TRACE_BEGIN( wait_ns);
+    int ready = event_wait( -1);
+    TRACE_END( TRACE_WAIT, wait_ns);
+    if( ready != 1)
+      return KEY_NONE;
+    input_read();
+  }
+}
+
+//不等待：解码已经到达的下一个按键，没有时返回KEY_NONE
+int input_next_pending(){
+  int key = input_decode();
+  if( key == KEY_NONE && input_read())
+    key = input_decode();
+  return key;
+}
+
+//input system
+//等到第一个按键后，把已经到达的按键全部处理完再返回，主循环只刷新一次屏幕
 void input_system() {
   int c = get_read_from_keyboard();
+  TRACE_BEGIN( keys_ns);
+  while( c != KEY_NONE){
+    input_process_key( c);
+    c = input_next_pending();
+  }
+  TRACE_END( TRACE_KEYS, keys_ns);
+}
+
+//在消息栏显示提示并读入一行文字，prompt中的%s显示已输入的内容，text.prompt_info附加在后面
+//回车返回输入的内容(由调用者free)，ESC取消返回NULL；每个按键和每次其他事件(KEY_NONE)之后都调用callback
+char* text_prompt( const char* prompt, void ( *callback)( char* buf, int key)){
+  size_t cap = 128;
+  size_t len = 0;
+  char* buf = malloc( cap);
+  if( buf == NULL)
+    error_information( "malloc");
+  buf[0] = '\0';
+
+  while( 1){
+    int n = snprintf( text.message, sizeof( text.message), prompt, buf);
+    if( n >= 0 && n < ( int)sizeof( text.message) && text.prompt_info[0])
+      snprintf( &text.message[n], sizeof( text.message) - n, " %s", text.prompt_info);
+    refresh_screen();
+
+    int c = get_read_from_keyboard();
+    if( c == BACKSPACE || c == WITH_CTRL('h') || c == DEL_KEY){
+      if( len > 0)
+        buf[--len] = '\0';
+    } else if( c == '\x1b' || ( c == '\r' && len > 0)){
+      text.message[0] = '\0';
+      if( callback)
+        callback( buf, c);
+      if( c == '\x1b'){
+        free( buf);
+        return NULL;
+      }
+      return buf;
+    } else if( c == PASTE_START){
+      text.pasting = 1;
+    } else if( c == PASTE_END){
+      text.pasting = 0;
+    } else if( c == PASTE_DATA || ( c < 256 && !iscntrl( c))){
+      char ch = c;
+      const char* s = c == PASTE_DATA ? text.paste_ptr : &ch;
+      int s_len = c == PASTE_DATA ? text.paste_len : 1;
+      int i = -1;
+      for( i = 0; i < s_len; ++i){
+        if( iscntrl( ( unsigned char)s[i]))  //粘贴的换行等控制字符不放进提示框
+          continue;
+        if( len + 1 == cap){
+          cap *= 2;
+          char* new_ = realloc( buf, cap);
+          if( new_ == NULL)
+            error_information( "realloc");
+          buf = new_;
+        }
+        buf[len++] = s[i];
+        buf[len] = '\0';
+      }
+    }
+    if( callback)
+      callback( buf, c);
+  }
+}
+
+//处理一个按键
+void input_process_key( int c) {
   /* 测试
     if( iscntrl(c)){  //iscntrl(c)检查c是否为c语言中的控制字符
         printf( "%d\r\n", c);   //c为控制字符，打印c的ASCII码
@@ -551,46 +5431,1178 @@ void input_system() {
       printf( "%d('%c')\r\n", c, c);  //打印c的ASCII码，并输出c
     }
   */
+  if( grep.active && grep_key( c))
+    return;
+  undo_begin();  //一个按键产生的编辑操作一起撤销
   if( c == WITH_CTRL('q') ){ //当按下Ctrl-q/Q 时退出
+    text_save_wait(); //正在保存时等它完成，不留下临时文件
     clear_screen();   //清除屏幕，atexit()也可以在退出时清除屏幕，但是error_information()的错误信息也会被清除
+#ifdef KILO_TRACE
+    if( getenv( "KILO_FRAME_STATS") && text.frame_count) //跟踪版本中设置该环境变量时退出前打印每帧输出字节数和耗时的统计
+      dprintf( STDERR_FILENO, "frames: %lld, bytes: %lld, bytes/frame: %lld, build us/frame: %lld, write us/frame: %lld\r\n",
+        text.frame_count, text.total_bytes, text.total_bytes / text.frame_count,
+        text.total_build_ns / text.frame_count / 1000, text.total_write_ns / text.frame_count / 1000);
+#endif
     exit(0);
   } else if( c == ARROW_UP || c == ARROW_DOWN || c == ARROW_LEFT || c == ARROW_RIGHT) {
     move_cursor( c);
   } else if( c == HOME_KEY ) {
-    text.cursor_x = 0;
+    text.buf->cursor_x = 0;
   } else if ( c == END_KEY ) {
-    text.cursor_x = text.screen_cols - 1;
+    if( text.buf->cursor_y < text.buf->number_rows)
+      text.buf->cursor_x = text_row_size( text.buf->cursor_y);
   } else if( c == PAGE_UP || c == PAGE_DOWN ) {
     int times_ = text.screen_rows;
-    while ( times--){
+    while ( times_--){
       move_cursor( c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
     }
+  } else if( c == WITH_CTRL('f')) {
+    text_find();
+  } else if( c == WITH_CTRL('s')) {
+    text_save();
+  } else if( c == WITH_CTRL('z')) {
+    text_undo();
+  } else if( c == WITH_CTRL('y')) {
+    text_redo();
+  } else if( c == WITH_CTRL('o')) {
+    buffer_prompt_open();
+  } else if( c == WITH_CTRL('w')) {
+    buffer_close();
+  } else if( c == WITH_CTRL('l')) {
+    text_follow_toggle();
+  } else if( c == WITH_CTRL('g')) {
+    text_grep();
+  } else if( c == WITH_CTRL('n') || c == WITH_CTRL('p')) {
+    buffer_next( c == WITH_CTRL('n') ? 1 : -1);
+#ifdef KILO_TRACE
+  } else if( c == WITH_CTRL('t')) { //显示或隐藏性能浮层
+    trace.overlay = !trace.overlay;
+#endif
+  } else if( c == '\r') {
+    text_insert_newline();
+  } else if( c == BACKSPACE || c == WITH_CTRL('h') || c == DEL_KEY) {
+    if( c == DEL_KEY)
+      move_cursor( ARROW_RIGHT);
+    text_delete_char();
+  } else if( c == PASTE_START) {
+    text.pasting = 1;
+    text.paste_cr = 0;
+  } else if( c == PASTE_END) {
+    text.pasting = 0;
+  } else if( c == PASTE_DATA) {
+    text_paste( text.paste_ptr, text.paste_len);
+  } else if( c < 256 && ( !iscntrl( c) || c == '\t')) {
+    text_insert_char( c);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef KILO_BENCH
+
+/*** bench ***/
+//性能测试，只在 make bench (定义KILO_BENCH) 时编译，输出为逗号分隔的一行一条结果，方便比较
+
+//生成size字节的测试文本：长度随机的行，约四分之一的行含有tab
+char* bench_make_text( size_t size){
+  char* p = malloc( size);
+  if( p == NULL)
+    error_information( "malloc");
+  unsigned int seed = 12345;
+  size_t i = 0;
+  while( i < size){
+    seed = seed * 1103515245u + 12345u;
+    size_t len = ( seed >> 16) % 120;
+    int with_tab = ( ( seed >> 8) & 3) == 0;
+    size_t j = 0;
+    for( j = 0; j < len && i < size; ++j, ++i)
+      p[i] = ( with_tab && j == len / 2) ? '\t' : 'a' + ( ( i + j) % 26);
+    if( i < size)
+      p[i++] = '\n';
+  }
+  return p;
+}
+
+//旧的扫描方式：逐字节找换行(getline)、逐字节去掉行尾、再逐字节统计tab(text_update_row)
+size_t bench_scan_bytewise( const char* p, size_t n, size_t* tab_lines){
+  size_t lines = 0;
+  size_t pos = 0;
+  while( pos < n){
+    size_t start = pos;
+    while( pos < n && p[pos] != '\n')
+      ++pos;
+    size_t end = pos;
+    if( pos < n)
+      ++pos;
+    while( end > start && ( p[end - 1] == '\n' || p[end - 1] == '\r'))
+      --end;
+    int tabs = 0;
+    size_t j = 0;
+    for( j = start; j < end; ++j)
+      if( p[j] == '\t')
+        ++tabs;
+    if( tabs)
+      ++*tab_lines;
+    ++lines;
+  }
+  return lines;
+}
+
+//用扫描内核建立行索引时的扫描方式
+size_t bench_scan_kernel( Scan_line_fn fn, const char* p, size_t n, size_t* tab_lines){
+  size_t lines = 0;
+  const char* q = p;
+  const char* end = p + n;
+  while( q < end){
+    unsigned flags = 0;
+    q = fn( q, end, &flags);
+    if( flags & ROW_HAS_TAB)
+      ++*tab_lines;
+    ++lines;
+    if( q < end)
+      ++q;
+  }
+  return lines;
+}
+
+//比较逐字节循环和各个扫描内核的吞吐量
+void bench_scan( size_t mb){
+  size_t n = mb << 20;
+  char* p = bench_make_text( n);
+  struct {
+    const char* name;
+    Scan_line_fn fn;
+  } kernels[4];
+  int count = 0;
+  kernels[count].name = "scalar";
+  kernels[count++].fn = scan_line_end_scalar;
+#if defined( __x86_64__) || defined( __i386__)
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports( "sse2")){
+    kernels[count].name = "sse2";
+    kernels[count++].fn = scan_line_end_sse2;
+  }
+  if( __builtin_cpu_supports( "avx2")){
+    kernels[count].name = "avx2";
+    kernels[count++].fn = scan_line_end_avx2;
+  }
+#endif
+
+  printf( "bench,kernel,mb,ms,gb_per_s,lines,tab_lines\n");
+  size_t tab_lines = 0;
+  long long t0 = now_ns();
+  size_t lines = bench_scan_bytewise( p, n, &tab_lines);
+  long long t1 = now_ns();
+  printf( "scan,bytewise,%zu,%.1f,%.2f,%zu,%zu\n", mb, ( t1 - t0) / 1e6, n / ( double)( t1 - t0), lines, tab_lines);
+
+  int i = -1;
+  for( i = 0; i < count; ++i){
+    size_t k_tabs = 0;
+    t0 = now_ns();
+    size_t k_lines = bench_scan_kernel( kernels[i].fn, p, n, &k_tabs);
+    t1 = now_ns();
+    printf( "scan,%s,%zu,%.1f,%.2f,%zu,%zu%s\n", kernels[i].name, mb, ( t1 - t0) / 1e6, n / ( double)( t1 - t0),
+      k_lines, k_tabs, ( k_lines == lines && k_tabs == tab_lines) ? "" : ",MISMATCH");
+  }
+  free( p);
+}
+
+//搜索一次并等待所有分片扫描完，返回耗时，*matches为匹配总数
+long long bench_search_run( const char* query, long long* matches){
+  int i = -1;
+  search_update( "");  //清掉上一次的结果，下一次完整扫描
+  long long t0 = now_ns();
+  search_update( query);
+  search_wait();
+  long long t1 = now_ns();
+  *matches = 0;
+  for( i = 0; i < search.shard_count; ++i)
+    *matches += search.shards[i].count;
+  return t1 - t0;
+}
+
+//输出一条搜索结果
+void bench_search_print( const char* kernel, const char* query, const char* mode, size_t mb, long long ns, long long matches){
+  char name[32];
+  int i = -1, j = 0;
+  for( i = 0; query[i] && j < ( int)sizeof( name) - 3; ++i){ //tab写成\t，保持一行一条结果
+    if( query[i] == '\t'){
+      name[j++] = '\\';
+      name[j++] = 't';
+    } else {
+      name[j++] = query[i];
+    }
+  }
+  name[j] = '\0';
+  printf( "search,%s,%d,%s,%s,%zu,%.1f,%.2f,%lld\n", kernel, search.thread_count, name, mode,
+    mb, ns / 1e6, ( mb << 20) / ( double)ns, matches);
+}
+
+//在mb MB的测试文本上测量搜索吞吐量：各个搜索内核、不同线程数，以及内容加长时只检查上一次匹配位置的情况
+void bench_search( size_t mb){
+  const char* queries[] = { "hello world", "kmoq", "q\t"};
+  int q = -1;
+  long long matches = 0;
+  long long ns = 0;
+  init_text_state( 50, 200);
+  int max_threads = search.thread_count;
+  text_open_memory( bench_make_text( mb << 20), mb << 20);
+  while( !text.buf->index_done){
+    text_load_sync();
+    usleep( 1000);
+  }
+  search_begin();
+
+  struct {
+    const char* name;
+    Search_fn fn;
+  } kernels[2];
+  int count = 0;
+  kernels[count].name = "memmem";
+  kernels[count++].fn = search_memmem_libc;
+#if defined( __x86_64__) || defined( __i386__)
+  if( __builtin_cpu_supports( "avx2")){
+    kernels[count].name = "avx2";
+    kernels[count++].fn = search_memmem_avx2;
+  }
+#endif
+
+  printf( "bench,kernel,threads,query,mode,mb,ms,gb_per_s,matches\n");
+  int k = -1;
+  for( k = 0; k < count; ++k){
+    search_memmem = kernels[k].fn;
+    int t = 1;
+    while( 1){
+      search.thread_count = t;
+      for( q = 0; q < ( int)( sizeof( queries) / sizeof( queries[0])); ++q){
+        ns = bench_search_run( queries[q], &matches);
+        bench_search_print( kernels[k].name, queries[q], "scan", mb, ns, matches);
+      }
+      if( t == max_threads)
+        break;
+      t = t * 2 < max_threads ? t * 2 : max_threads;
+    }
+  }
+
+  //加长搜索内容：上一次的结果完整时只检查记录的位置，和完整扫描的结果应当相同
+  search.thread_count = max_threads;
+  bench_search_run( "q\t", &matches);
+  long long t0 = now_ns();
+  search_update( "q\tu");
+  int filtered = search.filter;
+  search_wait();
+  ns = now_ns() - t0;
+  long long filter_matches = 0;
+  for( q = 0; q < search.shard_count; ++q)
+    filter_matches += search.shards[q].count;
+  bench_search_print( kernels[count - 1].name, "q\tu", filtered ? "filter" : "scan", mb, ns, filter_matches);
+  ns = bench_search_run( "q\tu", &matches);
+  printf( "search,%s,%d,q\\tu,scan,%zu,%.1f,%.2f,%lld%s\n", kernels[count - 1].name, search.thread_count, mb,
+    ns / 1e6, ( mb << 20) / ( double)ns, matches, matches == filter_matches ? "" : ",MISMATCH");
+
+  //记录满的分片在查找下一个时从中间重新扫描后只剩后一部分，加长内容时不能再过滤，否则前面的匹配会丢掉
+  long long full = 0, key = 0;
+  bench_search_run( "kmoq", &full);
+  bench_search_run( "kmo", &matches);
+  for( q = 0; q < search.shard_count; ++q)  //向后翻到每个分片的最后一个匹配
+    while( search.shards[q].more)
+      search_shard_next( &search.shards[q], search.shards[q].hits[search.shards[q].hit_count - 1], &key);
+  search_update( "kmoq");
+  filtered = search.filter;
+  search_wait();
+  for( q = 0, matches = 0; q < search.shard_count; ++q)
+    matches += search.shards[q].count;
+  printf( "search,%s,%d,kmoq,%s,%zu,,,%lld%s\n", kernels[count - 1].name, search.thread_count,
+    filtered ? "refill_filter" : "refill_scan", mb, matches, matches == full ? "" : ",MISMATCH");
+
+  search_end();
+  free( text.buf->map);
+}
+
+//当前的常驻内存(KB)
+long bench_rss_kb(){
+  long pages = 0, rss = 0;
+  FILE* f = fopen( "/proc/self/statm", "r");
+  if( f == NULL)
+    return 0;
+  if( fscanf( f, "%ld %ld", &pages, &rss) != 2)
+    rss = 0;
+  fclose( f);
+  return rss * ( sysconf( _SC_PAGESIZE) / 1024);
+}
+
+//生成lines行很短(0到7个字符)的测试文本
+char* bench_make_short_lines( size_t lines, size_t* size){
+  size_t i = 0;
+  *size = 0;
+  for( i = 0; i < lines; ++i)
+    *size += i % 8 + 1;
+  char* p = malloc( *size);
+  if( p == NULL)
+    error_information( "malloc");
+  char* q = p;
+  for( i = 0; i < lines; ++i){
+    memset( q, 'a' + i % 26, i % 8);
+    q += i % 8;
+    *q++ = '\n';
+  }
+  return p;
+}
+
+//输出一条行存储测试结果
+void bench_rows_print( const char* phase, const char* alloc, size_t lines, long long ns, long rss_kb){
+  printf( "rows,%s,%s,%zu,%.1f,%.1f,%.1f\n", phase, alloc, lines, ns / 1e6, rss_kb / 1024.0, rss_kb * 1024.0 / lines);
+}
+
+//大量短行：加载、把行改成编辑过的行、关闭，每一步的耗时和增加的常驻内存
+//另外按旧的方式(每行的片段、String_row、内容各malloc一次)分配同样多的行作为对照
+void bench_rows( size_t lines){
+  size_t size = 0;
+  size_t i = 0;
+  size_t edits = lines < 2000000 ? lines : 2000000;
+  init_text_state( 50, 200);
+  char* data = bench_make_short_lines( lines, &size);
+  void** ptrs = malloc( sizeof( void*) * 3 * edits);
+  if( ptrs == NULL)
+    error_information( "malloc");
+  memset( ptrs, 0, sizeof( void*) * 3 * edits);
+
+  printf( "bench,phase,alloc,lines,ms,rss_mb,bytes_per_row\n");
+  long rss = bench_rss_kb();
+  long long t0 = now_ns();
+  text_open_memory( data, size);
+  while( !text.buf->index_done){
+    text_load_sync();
+    usleep( 1000);
+  }
+  bench_rows_print( "load", "index", lines, now_ns() - t0, bench_rss_kb() - rss);
+
+  //移动光标时只读行长度：逐行取一遍长度
+  long long total = 0;
+  t0 = now_ns();
+  for( i = 0; i < lines; ++i)
+    total += text_row_size( i);
+  bench_rows_print( "sizes", "index", lines, now_ns() - t0, 0);
+  if( ( size_t)total + lines != size)
+    printf( "rows,sizes,MISMATCH\n");
+
+  rss = bench_rss_kb();
+  t0 = now_ns();
+  for( i = 0; i < edits; ++i)
+    text_row_edit( i);
+  bench_rows_print( "edit", "arena", edits, now_ns() - t0, bench_rss_kb() - rss);
+
+  t0 = now_ns();
+  text_close();
+  bench_rows_print( "close", "arena", edits, now_ns() - t0, 0);
+
+  //只比较分配本身：每行一个片段节点、一个String_row和内容，每块都写一下让页面真正分配
+  rss = bench_rss_kb();
+  t0 = now_ns();
+  for( i = 0; i < edits; ++i){
+    *( char*)arena_alloc( &text.buf->arena, sizeof( Row_piece)) = 1;
+    *( char*)arena_alloc( &text.buf->arena, sizeof( String_row)) = 1;
+    *( char*)arena_alloc( &text.buf->grow, i % 8 + 1) = 1;
+  }
+  bench_rows_print( "alloc", "arena", edits, now_ns() - t0, bench_rss_kb() - rss);
+  t0 = now_ns();
+  arena_release( &text.buf->arena);
+  arena_release( &text.buf->grow);
+  bench_rows_print( "free", "arena", edits, now_ns() - t0, 0);
+
+  rss = bench_rss_kb();
+  t0 = now_ns();
+  for( i = 0; i < edits; ++i){
+    ptrs[3 * i] = malloc( sizeof( Row_piece));
+    ptrs[3 * i + 1] = malloc( sizeof( String_row));
+    ptrs[3 * i + 2] = malloc( i % 8 + 1);
+    if( !ptrs[3 * i] || !ptrs[3 * i + 1] || !ptrs[3 * i + 2])
+      error_information( "malloc");
+    *( char*)ptrs[3 * i] = *( char*)ptrs[3 * i + 1] = *( char*)ptrs[3 * i + 2] = 1;
+  }
+  bench_rows_print( "alloc", "malloc", edits, now_ns() - t0, bench_rss_kb() - rss);
+  t0 = now_ns();
+  for( i = 0; i < 3 * edits; ++i)
+    free( ptrs[i]);
+  bench_rows_print( "free", "malloc", edits, now_ns() - t0, 0);
+  free( ptrs);
+}
+
+//生成lines行、每行len字节的长行，由sep分开的单词组成
+char* bench_make_long_lines( size_t lines, size_t len, char sep, size_t* size){
+  size_t i = 0, j = 0;
+  *size = lines * ( len + 1);
+  char* p = malloc( *size);
+  if( p == NULL)
+    error_information( "malloc");
+  char* q = p;
+  for( i = 0; i < lines; ++i){
+    for( j = 0; j < len; ++j)
+      *q++ = ( j % 8 == 7) ? sep : ( char)( 'a' + ( i + j) % 26);
+    *q++ = '\n';
+  }
+  return p;
+}
+
+//生成size字节tab很多的文本：每行4到15个用tab分隔的短字段
+char* bench_make_tabs( size_t size){
+  char* p = malloc( size);
+  if( p == NULL)
+    error_information( "malloc");
+  unsigned int seed = 4321;
+  size_t i = 0;
+  while( i < size){
+    seed = seed * 1103515245u + 12345u;
+    int fields = 4 + ( seed >> 16) % 12;
+    int f = -1;
+    for( f = 0; f < fields && i < size; ++f){
+      int w = 1 + ( seed >> f) % 9;
+      while( w-- > 0 && i < size){
+        p[i] = 'a' + i % 26;
+        ++i;
+      }
+      if( i < size)
+        p[i++] = '\t';
+    }
+    if( i < size)
+      p[i++] = '\n';
+  }
+  return p;
+}
+
+//生成size字节的中英文混合文本：按词生成，一半是英文单词，其余是汉字词、带重音和组合字符的拉丁字母词和emoji
+//line_len为0时每行4到20个词，否则每行约line_len个字节
+char* bench_make_utf8( size_t size, size_t line_len){
+  static const char* const cjk[] = { "\xe4\xb8\xad", "\xe6\x96\x87", "\xe8\xa1\x8c", "\xe5\xad\x97", "\xe3\x81\x82", "\xef\xbc\x8c"};
+  static const char* const latin[] = { "\xc3\xa9", "\xc3\xb6", "e\xcc\x81", "\xd0\xb4"};
+  char* p = malloc( size);
+  if( p == NULL)
+    error_information( "malloc");
+  unsigned int seed = 777;
+  size_t i = 0, line = 0;
+  int words = 10;
+  while( i + 32 < size){
+    seed = seed * 1103515245u + 12345u;
+    if( line_len ? line >= line_len : words-- == 0){
+      p[i++] = '\n';
+      line = 0;
+      words = 4 + ( seed >> 16) % 17;
+      continue;
+    }
+    int kind = ( seed >> 8) % 10, len = 2 + ( seed >> 16) % 6, k = -1;
+    size_t start = i;
+    for( k = 0; k < len; ++k){
+      const char* g = kind < 5 ? "a" : kind < 8 ? cjk[( seed >> ( k + 4)) % 6] : kind < 9 ? latin[( seed >> ( k + 4)) % 4] : "\xf0\x9f\x98\x80";
+      if( kind == 8 && k % 2 == 0)
+        g = "a";
+      size_t n = strlen( g);
+      memcpy( p + i, g, n);
+      if( *g == 'a')
+        p[i] = 'a' + ( seed >> ( k + 8)) % 26;
+      i += n;
+    }
+    p[i++] = ' ';
+    line += i - start;
+  }
+  while( i < size)  //最后不放半个字符
+    p[i++] = '\n';
+  return p;
+}
+
+//把测试文本写到临时文件，文件名以suffix结尾(决定语法高亮)，返回文件名，由调用者unlink并free
+char* bench_write_corpus( const char* data, size_t n, const char* suffix){
+  char* name = malloc( 32 + strlen( suffix));
+  if( name == NULL)
+    error_information( "malloc");
+  sprintf( name, "/tmp/kilo_bench_XXXXXX%s", suffix);
+  int fd = mkstemps( name, strlen( suffix));
+  if( fd == -1)
+    error_information( "mkstemps");
+  size_t off = 0;
+  while( off < n){
+    ssize_t w = write( fd, data + off, n - off);
+    if( w <= 0)
+      error_information( "write");
+    off += w;
+  }
+  close( fd);
+  return name;
+}
+
+//测试时屏幕输出直接丢掉，字节数已经由refresh_screen统计
+void bench_sink( const char* b, int len){
+  ( void)b;
+  ( void)len;
+}
+
+//按键脚本，和终端发送的字节相同，由input_decode解码：翻页、移动、跳到行尾、输入、再翻回来
+void bench_make_script( struct String_buff* script){
+  int i = -1;
+  for( i = 0; i < 100; ++i)
+    string_buff_append( script, "\x1b[6~", 4);
+  for( i = 0; i < 50; ++i)
+    string_buff_append( script, "\x1b[B", 3);
+  string_buff_append( script, "\x1b[F", 3);
+  for( i = 0; i < 100; ++i)
+    string_buff_append( script, "\x1b[D", 3);
+  string_buff_append( script, "\x1b[H", 3);
+  string_buff_append( script, "hello world", 11);
+  for( i = 0; i < 50; ++i)
+    string_buff_append( script, "\x1b[C", 3);
+  for( i = 0; i < 100; ++i)
+    string_buff_append( script, "\x1b[5~", 4);
+}
+
+int bench_cmp_ll( const void* a, const void* b){
+  long long x = *( const long long*)a, y = *( const long long*)b;
+  return x < y ? -1 : x > y;
+}
+
+//打开一个测试文件，记录第一帧和建完索引的时间，然后按脚本逐个按键刷新屏幕，统计每帧的耗时、字节数和分配次数
+void bench_render_corpus( const char* corpus, char* data, size_t n, const char* suffix, struct String_buff* script){
+  char* name = bench_write_corpus( data, n, suffix);
+  free( data);
+
+  long long t0 = now_ns();
+  text_open( name);
+  refresh_screen();
+  long long first_ns = now_ns() - t0;
+  while( !text.buf->index_done){
+    usleep( 1000);
+    text_load_sync();
+  }
+  long long index_ns = now_ns() - t0;
+
+  long long* times = malloc( sizeof( long long) * script->len);
+  if( times == NULL)
+    error_information( "malloc");
+  memcpy( text.in_buf, script->b, script->len);
+  text.in_start = 0;
+  text.in_len = script->len;
+  int frames = 0;
+  long long bytes = 0, allocs = 0, build = 0;
+  int key = KEY_NONE;
+  while( ( key = input_decode()) != KEY_NONE){
+    input_process_key( key);
+    long long a0 = bench_allocs;
+    refresh_screen();
+    allocs += bench_allocs - a0;
+    bytes += text.frame_bytes;
+    build += text.frame_build_ns;
+    times[frames++] = text.frame_build_ns;
+  }
+  qsort( times, frames, sizeof( long long), bench_cmp_ll);
+  printf( "render,%s,%.1f,%d,%.1f,%.1f,%d,%.1f,%.1f,%.1f,%lld,%.2f\n", corpus, n / 1048576.0, text.buf->number_rows,
+    first_ns / 1e6, index_ns / 1e6, frames, build / 1e3 / frames, times[frames * 99 / 100] / 1e3,
+    times[frames - 1] / 1e3, bytes / frames, allocs / ( double)frames);
+
+  free( times);
+  text_close();
+  unlink( name);
+  free( name);
+}
+
+//无终端运行：输出换成bench_sink，按键来自脚本，在几种生成的文件上测量打开和绘制
+void bench_render( size_t mb){
+  struct String_buff script;
+  size_t n = 0;
+  string_buff_init( &script);
+  bench_make_script( &script);
+  init_text_state( 50, 200);
+  output_sink = bench_sink;
+
+  printf( "bench,corpus,mb,lines,first_frame_ms,index_ms,frames,build_us_avg,build_us_p99,build_us_max,bytes_per_frame,allocs_per_frame\n");
+  bench_render_corpus( "huge", bench_make_text( mb << 20), mb << 20, "", &script);
+  bench_render_corpus( "huge_log", bench_make_text( mb << 20), mb << 20, ".log", &script); //同样的内容按日志着色
+  char* data = bench_make_long_lines( 64, 1 << 20, ' ', &n);
+  bench_render_corpus( "long_lines", data, n, "", &script);
+  data = bench_make_long_lines( 4, 64 << 20, '\t', &n); //几行64MB、每8个字节一个tab的超长行，End后在行尾附近绘制
+  bench_render_corpus( "long_tab_lines", data, n, "", &script);
+  bench_render_corpus( "tabs", bench_make_tabs( 64 << 20), 64 << 20, "", &script);
+  bench_render_corpus( "utf8", bench_make_utf8( 256 << 20, 0), 256 << 20, "", &script);
+  bench_render_corpus( "utf8_long_lines", bench_make_utf8( 64 << 20, 16 << 20), 64 << 20, "", &script);
+  string_buff_free( &script);
+}
+
+//打开name，均匀地编辑edits行后保存到另一个文件，输出生成计划和写出的时间
+void bench_save_run( const char* name, size_t mb, int edits, int use_copy){
+  text_open( ( char*)name);
+  while( !text.buf->index_done){
+    usleep( 1000);
+    text_load_sync();
+  }
+  int k = -1;
+  for( k = 0; k < edits && k < text.buf->number_rows; ++k)
+    text_row_insert_char( text_row_edit( ( long long)k * text.buf->number_rows / edits), 0, 'x');
+
+  long long t0 = now_ns();
+  save_plan();
+  long long plan_ns = now_ns() - t0;
+  size_t len = strlen( name);
+  save.path = malloc( len + 7);
+  if( save.path == NULL)
+    error_information( "malloc");
+  memcpy( save.path, name, len);
+  memcpy( save.path + len, ".saved", 7);
+  save.src_fd = text.buf->map_fd;
+  save.use_copy = use_copy;
+  save_worker( NULL);
+
+  struct stat st;
+  if( save.error || stat( save.path, &st) == -1 || ( size_t)st.st_size != ( mb << 20) + k)
+    fprintf( stderr, "save: wrong result %s\n", strerror( save.error));
+  printf( "save,%s,%zu,%d,%.1f,%.1f,%.2f\n", use_copy && save.use_copy ? "copy_file_range" : "writev", mb, k,
+    plan_ns / 1e6, save.ns / 1e6, ( mb << 20) / ( double)save.ns);
+  unlink( save.path);
+  free( save.path);
+  save.path = NULL;
+  text_close();
+}
+
+//原文件最后一行没有换行时编辑最后一行：保存的结果应当只多插入的一个字节，最后仍然没有换行
+void bench_save_last_row(){
+  size_t n = 1 << 20;
+  char* data = bench_make_text( n);
+  data[n - 1] = 'b';
+  char* name = bench_write_corpus( data, n, "");
+  text_open( name);
+  while( !text.buf->index_done){
+    usleep( 1000);
+    text_load_sync();
+  }
+  int last = text.buf->number_rows - 1;
+  size_t at = line_start_at( last);
+  text_row_insert_char( text_row_edit( last), 0, 'x');
+  save_plan();
+  size_t len = strlen( name);
+  save.path = malloc( len + 7);
+  if( save.path == NULL)
+    error_information( "malloc");
+  memcpy( save.path, name, len);
+  memcpy( save.path + len, ".saved", 7);
+  save.src_fd = text.buf->map_fd;
+  save.use_copy = 0;
+  save_worker( NULL);
+
+  char* out = malloc( n + 2);
+  int fd = open( save.path, O_RDONLY);
+  ssize_t got = fd == -1 ? -1 : read( fd, out, n + 2);
+  int ok = !save.error && got == ( ssize_t)n + 1 && memcmp( out, data, at) == 0 && out[at] == 'x'
+    && memcmp( out + at + 1, data + at, n - at) == 0;
+  if( fd != -1)
+    close( fd);
+  if( !ok)
+    fprintf( stderr, "save: wrong result after editing the last row without a newline\n");
+  printf( "save,last_row_no_eol,%zu,1,%s\n", n >> 20, ok ? "ok" : "MISMATCH");
+  unlink( save.path);
+  free( save.path);
+  save.path = NULL;
+  text_close();
+  unlink( name);
+  free( name);
+  free( out);
+  free( data);
+}
+
+//保存测试：文件大小和编辑行数分别变化，原始内容分别用copy_file_range和writev写出
+void bench_save( size_t mb){
+  size_t sizes[3] = { mb / 16, mb / 4, mb};
+  int edits[3] = { 0, 1000, 100000};
+  init_text_state( 50, 200);
+  output_sink = bench_sink;
+
+  printf( "bench,mode,mb,edited_rows,plan_ms,write_ms,gb_per_s\n");
+  int i = -1, j = -1;
+  for( i = 0; i < 3; ++i){
+    if( sizes[i] == 0)
+      continue;
+    char* data = bench_make_text( sizes[i] << 20);
+    char* name = bench_write_corpus( data, sizes[i] << 20, "");
+    free( data);
+    for( j = 0; j < 3; ++j){
+      bench_save_run( name, sizes[i], edits[j], 1);
+      bench_save_run( name, sizes[i], edits[j], 0);
+    }
+    unlink( name);
+    free( name);
+  }
+  bench_save_last_row();
+}
+
+//撤销测试：在mb大小的文件上做edits次分散的编辑，再全部撤销、全部重做，每次撤销和重做的耗时应与文件大小无关
+void bench_undo( size_t mb, int edits){
+  init_text_state( 50, 200);
+  output_sink = bench_sink;
+  char* data = bench_make_text( mb << 20);
+  char* name = bench_write_corpus( data, mb << 20, "");
+  free( data);
+  text_open( name);
+  while( !text.buf->index_done){
+    usleep( 1000);
+    text_load_sync();
+  }
+  int rows = text.buf->number_rows;
+
+  unsigned int seed = 99;
+  long long t0 = now_ns();
+  int i = -1;
+  for( i = 0; i < edits; ++i){
+    seed = seed * 1103515245u + 12345u;
+    text.buf->cursor_y = ( seed >> 4) % ( text.buf->number_rows - 1) + 1;
+    text.buf->cursor_x = 0;
+    undo_begin();
+    if( i % 4 == 3)
+      text_delete_char(); //在行首退格，合并到上一行
+    else if( i % 4 == 2)
+      text_insert_newline();
+    else
+      text_insert_char( 'a' + i % 26);
+  }
+  long long edit_ns = now_ns() - t0;
+
+  long long* times = malloc( sizeof( long long) * edits);
+  if( times == NULL)
+    error_information( "malloc");
+  int n = 0;
+  t0 = now_ns();
+  while( undo.cur > undo.first){
+    long long s = now_ns();
+    text_undo();
+    times[n++] = now_ns() - s;
+  }
+  long long undo_ns = now_ns() - t0;
+  qsort( times, n, sizeof( long long), bench_cmp_ll);
+  save_plan();
+  if( ( text.buf->number_rows != rows || save.total != mb << 20) && undo.first > 0)
+    fprintf( stderr, "undo: content differs after undoing everything (history over KILO_UNDO_MB is dropped)\n");
+  else if( text.buf->number_rows != rows || save.total != mb << 20)
+    fprintf( stderr, "undo: MISMATCH after undoing everything: %d rows, %zu bytes, expected %d rows, %zu bytes\n",
+      text.buf->number_rows, save.total, rows, ( size_t)( mb << 20));
+  t0 = now_ns();
+  while( undo.cur < undo.count)
+    text_redo();
+  long long redo_ns = now_ns() - t0;
+
+  printf( "bench,mb,edits,undo_ops,undo_mb,edit_us_avg,undo_us_avg,undo_us_p99,undo_us_max,redo_us_avg\n");
+  printf( "undo,%zu,%d,%d,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f\n", mb, edits, undo.count - undo.first, undo.mem / 1048576.0,
+    edit_ns / 1e3 / edits, undo_ns / 1e3 / n, times[n * 99 / 100] / 1e3, times[n - 1] / 1e3, redo_ns / 1e3 / n);
+  free( times);
+  text_close();
+  unlink( name);
+  free( name);
+}
+
+//打开一个测试文件，计算每行行尾的显示宽度(全部扫描)，再在行中随机位置转换显示列(使用列检查点)
+void bench_utf8_corpus( const char* corpus, char* data, size_t n){
+  char* name = bench_write_corpus( data, n, "");
+  free( data);
+  text_open( name);
+  while( !text.buf->index_done){
+    usleep( 1000);
+    text_load_sync();
+  }
+  long long width = 0;
+  long long t0 = now_ns();
+  int i = -1;
+  for( i = 0; i < text.buf->number_rows; ++i){
+    String_row* row = text_row_at( i);
+    width += text_row_cx_to_rx( row, row->size);
+  }
+  long long scan_ns = now_ns() - t0;
+
+  unsigned int seed = 31;
+  int lookups = 1000000, start_rx = 0;
+  t0 = now_ns();
+  for( i = 0; i < lookups; ++i){
+    seed = seed * 1103515245u + 12345u;
+    String_row* row = text_row_at( ( seed >> 8) % text.buf->number_rows);
+    seed = seed * 1103515245u + 12345u;
+    int rx = text_row_cx_to_rx( row, ( seed >> 4) % ( row->size + 1));
+    width += text_row_rx_to_cx( row, rx, &start_rx);
+  }
+  long long lookup_ns = now_ns() - t0;
+  printf( "utf8,%s,%.1f,%d,%.1f,%.1f,%.1f,%lld\n", corpus, n / 1048576.0, text.buf->number_rows,
+    scan_ns / 1e6, n / 1048576.0 / ( scan_ns / 1e9), lookup_ns / ( double)lookups, width);
+  text_close();
+  unlink( name);
+  free( name);
+}
+
+//显示宽度测试：纯ASCII的行不解码，含多字节字符的行逐字符解码，长行中的随机位置只扫描一个检查点段
+void bench_utf8( size_t mb){
+  init_text_state( 50, 200);
+  output_sink = bench_sink;
+  printf( "bench,corpus,mb,lines,width_ms,width_mb_s,lookup_ns,checksum\n");
+  bench_utf8_corpus( "ascii", bench_make_text( mb << 20), mb << 20);
+  bench_utf8_corpus( "ascii_tabs", bench_make_tabs( mb << 20), mb << 20); //需要逐段计算宽度的ASCII行，作为比较的基准
+  bench_utf8_corpus( "utf8", bench_make_utf8( mb << 20, 0), mb << 20);
+  bench_utf8_corpus( "utf8_long_lines", bench_make_utf8( mb << 20, 16 << 20), mb << 20);
+}
+
+//在base_mb MB的文件后面每次追加chunk字节并跟随，测量从inotify事件到新行显示出来的时间
+//追加的内容由bench_make_text生成，结尾常常是半行，下一次追加时接上
+void bench_follow_run( size_t base_mb, size_t chunk, int appends){
+  char* name = bench_write_corpus( bench_make_text( base_mb << 20), base_mb << 20, ".log");
+  text_open( name);
+  while( !text.buf->index_done){
+    usleep( 1000);
+    text_load_sync();
+  }
+  if( follow_start( text.buf->file, name) == -1)
+    error_information( "follow");
+  text.buf->cursor_y = text.buf->number_rows - 1; //光标在最后一行，跟着新内容走
+  refresh_screen();
+
+  char* data = bench_make_text( chunk);
+  int fd = open( name, O_WRONLY | O_APPEND);
+  if( fd == -1)
+    error_information( "open");
+  long long total = 0, max = 0;
+  int i = -1;
+  for( i = 0; i < appends; ++i){
+    if( write( fd, data, chunk) != ( ssize_t)chunk)
+      error_information( "write");
+    long long t0 = now_ns();
+    follow_on_event( text.inotify_fd);
+    refresh_screen();
+    while( !text.buf->index_done){
+      usleep( 100);
+      refresh_screen();
+    }
+    long long ns = now_ns() - t0;
+    total += ns;
+    if( ns > max)
+      max = ns;
+  }
+  close( fd);
+  free( data);
+
+  //行数应当等于换行数，最后没有换行时再加一行；光标应当在最后一行
+  long long lines = 0;
+  const char* p = text.buf->map;
+  const char* end = p + text.buf->map_size;
+  while( ( p = memchr( p, '\n', end - p)) != NULL){
+    ++lines;
+    ++p;
+  }
+  if( text.buf->map_size > 0 && end[-1] != '\n')
+    ++lines;
+  int ok = lines == text.buf->number_rows && text.buf->cursor_y == text.buf->number_rows - 1
+    && text.buf->map_size == ( base_mb << 20) + chunk * appends;
+  printf( "follow,%zu,%zu,%d,%.1f,%.1f,%.1f,%s\n", base_mb, chunk >> 10, appends, total / 1e3 / appends,
+    max / 1e3, ( double)chunk * appends / 1048576.0 / ( total / 1e9), ok ? "ok" : "MISMATCH");
+  text_close();
+  unlink( name);
+  free( name);
+}
+
+//追加的开销应当只和追加的字节数有关，和文件原来有多大无关
+void bench_follow( size_t mb){
+  size_t chunks[] = { 4 << 10, 64 << 10, 1 << 20, 16 << 20};
+  size_t bases[] = { 16, mb};
+  int b = -1, c = -1;
+  init_text_state( 50, 200);
+  output_sink = bench_sink;
+  printf( "bench,base_mb,append_kb,appends,us_avg,us_max,mb_per_s,check\n");
+  for( b = 0; b < 2; ++b)
+    for( c = 0; c < 4; ++c)
+      bench_follow_run( bases[b], chunks[c], chunks[c] < ( 1 << 20) ? 500 : 64 * ( 1 << 20) / chunks[c]);
+}
+
+//进入grep视图并等到扫描结束，返回总时间，first为第一个分片并入列表的时间
+long long bench_grep_run( const char* pattern, long long* first, int* count){
+  long long t0 = now_ns();
+  *first = -1;
+  if( grep_begin( pattern) != 0)
+    error_information( "regcomp");
+  while( 1){
+    grep_sync();
+    if( *first < 0 && grep.merged > 0)
+      *first = now_ns() - t0;
+    if( !grep.running)
+      break;
+    usleep( 50);
+  }
+  long long ns = now_ns() - t0;
+  *count = grep.count;
+  grep_end();
+  return ns;
+}
+
+//正则过滤的吞吐量随线程数的变化，多线程的匹配行数应当和单线程相同；最后测扫描中途离开视图要等多久
+void bench_grep( size_t mb){
+  const char* patterns[] = { "kmoq", "^[a-e]+\t", "(abc|xyz).*q$"};
+  int expect[3] = { 0};
+  int p = -1, count = 0;
+  long long first = 0;
+  init_text_state( 50, 200);
+  int max_threads = search.thread_count;
+  text_open_memory( bench_make_text( mb << 20), mb << 20);
+  while( !text.buf->index_done){
+    text_load_sync();
+    usleep( 1000);
+  }
+
+  printf( "bench,threads,pattern,mb,ms,mb_per_s,first_ms,lines,check\n");
+  int t = 1;
+  while( 1){
+    search.thread_count = t;
+    for( p = 0; p < 3; ++p){
+      long long ns = bench_grep_run( patterns[p], &first, &count);
+      if( t == 1)
+        expect[p] = count;
+      printf( "grep,%d,%s,%zu,%.1f,%.1f,%.2f,%d,%s\n", t, patterns[p], mb, ns / 1e6, ( mb << 20) / 1048576.0 / ( ns / 1e9),
+        first / 1e6, count, count == expect[p] ? "ok" : "MISMATCH");
+    }
+    if( t == max_threads)
+      break;
+    t = t * 2 < max_threads ? t * 2 : max_threads;
+  }
+
+  grep_begin( patterns[2]);
+  usleep( 20000);
+  grep_sync();
+  long long t0 = now_ns();
+  grep_end();
+  printf( "grep_cancel,%d,%s,%zu,%.3f\n", search.thread_count, patterns[2], mb, ( now_ns() - t0) / 1e6);
+  free( text.buf->map);
+}
+
+//打开文件并等到行索引完整，返回所用的时间；sum是全部行的起始位置、长度和行标志的哈希
+long long bench_index_open( const char* name, uint64_t* sum){
+  long long t0 = now_ns();
+  if( text_open( ( char*)name) == -1)
+    error_information( "open");
+  while( !text.buf->index_done){
+    usleep( 100);
+    text_load_sync();
+  }
+  long long ns = now_ns() - t0;
+  int i = -1;
+  *sum = 14695981039346656037ull;
+  for( i = 0; i <= text.buf->line_count; ++i){
+    uint64_t v[3] = { line_start_at( i), 0, 0};
+    if( i < text.buf->line_count){
+      v[1] = line_len_at( i);
+      v[2] = line_flags_at( i) & ~( ROW_HL_KNOWN | ROW_HL_COMMENT);
+    }
+    *sum = index_fnv( *sum, v, sizeof( v));
+  }
+  return ns;
+}
+
+void bench_index_print( size_t mb, const char* what, long long ns, int ok){
+  printf( "index,%zu,%s,%.2f,%d,%d,%s\n", mb, what, ns / 1e6, text.buf->line_count, text.buf->file->index_cached, ok ? "ok" : "MISMATCH");
+}
+
+//第一次打开完整扫描并写缓存，再打开时映射缓存，两次的行索引应当相同；修改时间改变后应当完整扫描
+//长度和修改时间不变、内容在抽样之外改变时，显示到那一行应当发现缓存过时，重新打开并完整扫描
+void bench_index( size_t mb){
+  char dir[] = "/tmp/kilo_index_XXXXXX";
+  if( mkdtemp( dir) == NULL)
+    error_information( "mkdtemp");
+  setenv( "KILO_INDEX_CACHE", dir, 1);
+  char* name = bench_write_corpus( bench_make_text( mb << 20), mb << 20, ".txt");
+  init_text_state( 50, 200);
+  output_sink = bench_sink;
+  uint64_t scan_sum = 0, sum = 0;
+  printf( "bench,mb,open,ms,lines,cached,check\n");
+
+  long long ns = bench_index_open( name, &scan_sum);
+  int lines = text.buf->line_count;
+  bench_index_print( mb, "scan", ns, !text.buf->file->index_cached);
+  text_close();
+  ns = bench_index_open( name, &sum);
+  bench_index_print( mb, "cached", ns, text.buf->file->index_cached && sum == scan_sum);
+  text_close();
+
+  struct timespec times[2];
+  struct stat st;
+  int fd = open( name, O_RDWR);
+  if( fd == -1 || fstat( fd, &st) == -1)
+    error_information( "open");
+  times[0] = st.st_atim;
+  times[1] = st.st_mtim;
+  times[1].tv_sec -= 10;
+  futimens( fd, times);
+  ns = bench_index_open( name, &sum);
+  bench_index_print( mb, "mtime", ns, !text.buf->file->index_cached && sum == scan_sum);
+  text_close();
+
+  //在两块抽样之间把一个换行改成别的字符，再改回修改时间：打开时发现不了，第一次显示那一行时发现
+  size_t off = ( mb << 20) / 32;
+  char c = 0;
+  while( pread( fd, &c, 1, off) == 1 && c != '\n')
+    ++off;
+  c = 'x';
+  if( pwrite( fd, &c, 1, off) != 1)
+    error_information( "pwrite");
+  futimens( fd, times);
+  close( fd);
+  ns = bench_index_open( name, &sum);
+  int cached = text.buf->file->index_cached;
+  int lo = 0, hi = text.buf->line_count - 1;
+  while( lo < hi){  //off所在的行
+    int mid = lo + ( hi - lo + 1) / 2;
+    if( line_start_at( mid) <= off)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  long long t0 = now_ns();
+  text.buf->cursor_y = text.buf->row_off = lo;
+  refresh_screen(); //显示到改过的行，发现缓存过时
+  refresh_screen(); //下一帧重新打开
+  while( !text.buf->index_done){
+    usleep( 100);
+    text_load_sync();
+  }
+  ns = now_ns() - t0;
+  bench_index_print( mb, "stale", ns, cached && !text.buf->file->index_cached && text.buf->line_count == lines - 1);
+  text_close();
+
+  unlink( name);
+  free( name);
+  char cmd[64];
+  snprintf( cmd, sizeof( cmd), "rm -rf %s", dir);
+  if( system( cmd) != 0)
+    error_information( "rm");
+}
+
+//./kilo_bench --bench scan|search|render|save|utf8|follow|grep|index [MB]
+//./kilo_bench --bench undo [MB] [EDITS]
+//./kilo_bench --bench rows [LINES]
+int bench_main( int argc, char* argv[]){
+  setenv( "KILO_INDEX_CACHE", "0", 1); //反复打开同样的测试文件，只有index测试使用缓存
+  if( argc >= 1 && strcmp( argv[0], "scan") == 0){
+    bench_scan( argc >= 2 ? ( size_t)atol( argv[1]) : 1024);
+    return 0;
+  }
+  if( argc >= 1 && strcmp( argv[0], "search") == 0){
+    bench_search( argc >= 2 ? ( size_t)atol( argv[1]) : 2048);
+    return 0;
+  }
+  if( argc >= 1 && strcmp( argv[0], "render") == 0){
+    bench_render( argc >= 2 ? ( size_t)atol( argv[1]) : 1024);
+    return 0;
+  }
+  if( argc >= 1 && strcmp( argv[0], "save") == 0){
+    bench_save( argc >= 2 ? ( size_t)atol( argv[1]) : 1024);
+    return 0;
+  }
+  if( argc >= 1 && strcmp( argv[0], "utf8") == 0){
+    bench_utf8( argc >= 2 ? ( size_t)atol( argv[1]) : 256);
+    return 0;
+  }
+  if( argc >= 1 && strcmp( argv[0], "follow") == 0){
+    bench_follow( argc >= 2 ? ( size_t)atol( argv[1]) : 1024);
+    return 0;
+  }
+  if( argc >= 1 && strcmp( argv[0], "grep") == 0){
+    bench_grep( argc >= 2 ? ( size_t)atol( argv[1]) : 1024);
+    return 0;
+  }
+  if( argc >= 1 && strcmp( argv[0], "index") == 0){
+    bench_index( argc >= 2 ? ( size_t)atol( argv[1]) : 1024);
+    return 0;
+  }
+  if( argc >= 1 && strcmp( argv[0], "undo") == 0){
+    bench_undo( argc >= 2 ? ( size_t)atol( argv[1]) : 2048, argc >= 3 ? atoi( argv[2]) : 100000);
+    return 0;
+  }
+  if( argc >= 1 && strcmp( argv[0], "rows") == 0){
+    bench_rows( argc >= 2 ? ( size_t)atol( argv[1]) : 50000000);
+    return 0;
   }
+  fprintf( stderr, "usage: kilo_bench --bench scan|search|render|save|utf8|follow|grep|index [MB] | undo [MB] [EDITS] | rows [LINES]\n");
+  return 1;
 }
 
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /*** init system ***/
 
-void init_text(){
-  text.cursor_x = 0;
-  text.cursor_y = 0;
-  text.row_off = 0;
-  text.number_rows = 0;
-  text.row = NULL;
+//初始化编辑器状态，屏幕大小为rows行cols列；不涉及终端，测试时直接调用
+void init_text_state( int rows, int cols){
+  scan_init();
+  utf8_init();
+  text.buf = NULL;
+  text.buffers = NULL;
+  text.buffer_count = text.buffer_cap = 0;
+  text.buffer_clock = 0;
+  text.files = NULL;
+  text.wake_pipe[0] = text.wake_pipe[1] = -1;
+  text.inotify_fd = -1;
+  text.window_changed = 0;
+  text.event_count = 0;
+  text.in_start = text.in_len = 0;
+  text.pasting = 0;
+  text.paste_cr = 0;
+  text.paste_ptr = NULL;
+  text.paste_len = 0;
+  text.message[0] = '\0';
+  text.prompt_info[0] = '\0';
+  text.hl_buf = NULL;
+  text.hl_cap = 0;
+  search_init();
+  memset( &save, 0, sizeof( save));
+  string_buff_init( &save.edited);
+  save.src_fd = -1;
+  undo_init();
+  buffer_switch( buffer_new()); //开始时有一个空的缓冲区
+
+  text.screen_rows = rows - 2;  //最后两行留给状态栏和消息栏
+  text.screen_cols = cols;
+  text.shadow = calloc( text.screen_rows + 2, sizeof( struct String_buff));
+  if( text.shadow == NULL)
+    error_information( "calloc");
+  text.shadow_valid = 0;
+  text.shadow_row_off = 0;
+  text.shadow_cursor_row = 0;
+  text.frame_bytes = 0;
+  text.total_bytes = 0;
+  text.frame_count = 0;
+  text.frame_build_ns = text.frame_write_ns = 0;
+  text.total_build_ns = text.total_write_ns = 0;
+  string_buff_init( &text.out);
+  string_buff_init( &text.line);
+}
 
-  if( get_window_size( &text.screen_rows, &text.screen_cols) == -1 )
+void init_text(){
+  int rows = 0, cols = 0;
+  if( get_window_size( &rows, &cols) == -1 )
     error_information("get window size");
+  init_text_state( rows, cols);
+  event_init();
+#ifdef KILO_TRACE
+  trace_init();
+#endif
 }
 
 int main( int argc, char* argv[]){
   //命令行参数的使用：
     //./kilo xxx
     // argc = 2， argv[0] = "kilo", argv[1] = "xxx"
+#ifdef KILO_BENCH
+  if( argc >= 2 && strcmp( argv[1], "--bench") == 0)
+    return bench_main( argc - 2, argv + 2);
+#endif
   enable_raw_mode();
   init_text();
-  if( argc >= 2)
-    text_open( argv[1]);  
+  int i = 1, follow = 0;
+  for( i = 1; i < argc; ++i){ //每个文件一个缓冲区，从第一个开始显示；-f之后的文件跟随变化(tail -f)
+    if( strcmp( argv[i], "-f") == 0){
+      follow = 1;
+      continue;
+    }
+    if( buffer_open( argv[i]) == -1)
+      error_information( "open");
+    if( follow && follow_start( text.buf->file, argv[i]) == -1)
+      error_information( "follow");
+  }
+  buffer_switch( text.buffers[0]);
 
   while(1){
     refresh_screen();